@@ -41,17 +41,25 @@
 #define configUSE_PREEMPTION                1
 #define configUSE_IDLE_HOOK                 1
 #define configUSE_TICK_HOOK                 0
+#define configUSE_TICKLESS_IDLE             0   /* the idle hook sleeps between interrupts, see main.c */
 #define configCPU_CLOCK_HZ                  ( ( unsigned long ) 16000000 )
 #define configTICK_RATE_HZ                  ( ( TickType_t ) 100 )
-#define configMAX_PRIORITIES                ( 3 )
-#define configMINIMAL_STACK_SIZE            ( ( unsigned short ) 80 )
-#define configTOTAL_HEAP_SIZE               ( (size_t ) ( 1024) )
+#define portUSE_TIMER2                      /* tick from Timer2, Timer1 is left for ICP1 */
+#define portLEAN_YIELD                      /* vPortYield() skips the call-clobbered registers, see port.c */
+#define configMAX_PRIORITIES                ( 4 )   /* idle, MQTT, ESP8266 receive, HC-SR04, see main.c */
+#define configMINIMAL_STACK_SIZE            ( ( unsigned short ) 80 )  /* the idle stack is STACK_SIZE_IDLE, stack_sizes.h */
+#define configSUPPORT_STATIC_ALLOCATION     1   /* every object is a static, no heap is linked */
+#define configSUPPORT_DYNAMIC_ALLOCATION    0
 #define configMAX_TASK_NAME_LEN             ( 4 )
 #define configUSE_TRACE_FACILITY            0
+#define configGENERATE_RUN_TIME_STATS       1   /* counter is ulPortGetTimeUs(), see portmacro.h */
+#define configUSE_STATS_FORMATTING_FUNCTIONS 0
 #define configUSE_16_BIT_TICKS              1
 #define configIDLE_SHOULD_YIELD             1
 #define configQUEUE_REGISTRY_SIZE           0
 #define configSTACK_DEPTH_TYPE              uint16_t
+#define configCHECK_FOR_STACK_OVERFLOW      2   /* the hook lights mERROR_LED, see main.c */
+#define configTASK_NOTIFICATION_ARRAY_ENTRIES 2 /* index 1 is used by the drivers */
 
 /* Co-routine definitions. */
 #define configUSE_CO_ROUTINES               0
@@ -65,9 +73,10 @@ to exclude the API function. */
 #define INCLUDE_vTaskDelete                 0
 #define INCLUDE_vTaskCleanUpResources       0
 #define INCLUDE_vTaskSuspend                1
-#define INCLUDE_vTaskDelayUntil             0
+#define INCLUDE_vTaskDelayUntil             1
 #define INCLUDE_vTaskDelay                  1
-#define INCLUDE_uxTaskGetStackHighWaterMark2 0
+#define INCLUDE_uxTaskGetStackHighWaterMark2 1   /* 16 bit, stacks can be over 255 bytes */
+#define INCLUDE_xTaskGetIdleTaskHandle      1
 
 /* Configure pdMS_TO_TICKS and pdTICKS_TO_MS */
 #define pdMS_TO_TICKS(x)                    ((TickType_t) x / portTICK_PERIOD_MS)
@@ -33,10 +33,26 @@ extern "C" {
 
 typedef unsigned int hcsr04_data_t;
 
+//Number of samples kept by hcsr04_task, must be a power of two up to 128
+#define HCSR04_RING_LEN             8
+
+//Event bits sent to mqtt_task, notification index 0 with eSetBits
+#define APP_EVENT_SENSOR_READY      (1UL << 0)  //on demand reading is stored
+#define APP_EVENT_NETWORK_RX        (1UL << 1)  //transport received a payload
+#define APP_EVENT_ALL               (APP_EVENT_SENSOR_READY | APP_EVENT_NETWORK_RX)
+
+typedef struct hcsr04_sample {
+    uint32_t timestamp;       //ulPortGetTimeMs() when the measurement ended
+    hcsr04_data_t value;      //filtered echo width in us
+} hcsr04_sample_t;
+
 typedef struct app_data_handle  {
     hcsr04_data_t sensor_read; //data measured by hcsr04_task
+    hcsr04_sample_t samples[HCSR04_RING_LEN]; //written by hcsr04_task only
+    volatile uint16_t sample_count;           //free running, next slot to write, two bytes: read it in a critical section
     TaskHandle_t sensor_task; //hcsr04 task handle to signal to make new measurement
-    TaskHandle_t mqtt_task;   //mqtt task handle to signal measureament is ready
+    TaskHandle_t mqtt_task;   //mqtt task handle to signal measureament is ready (APP_EVENT_*)
+    volatile unsigned char mqtt_online; //set by mqtt_task while the broker is reachable
 } app_data_handle_t;
 
 #ifdef __cplusplus
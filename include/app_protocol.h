@@ -0,0 +1,92 @@
+/*
+ * MIT License
+ * Copyright (c) 2024 Vinicius Silva.  All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ */
+
+#ifndef APP_PROTOCOL_H
+#define APP_PROTOCOL_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stddef.h>
+#include <stdint.h>
+#include "FreeRTOS.h"
+
+/* Binary frames on the control and state topics, see doc/app_protocol.txt.
+ * Every frame is APP_FRAME_SIZE bytes, multi-byte fields little endian:
+ *
+ *   uint8_t  mark     APP_FRAME_MARK | version
+ *   uint8_t  opcode   app_opcode_t
+ *   uint8_t  seq      chosen by the host, echoed in the reply
+ *   uint8_t  arg      opcode specific
+ *   uint16_t value    opcode specific
+ *
+ * The mark byte is never printable ASCII, the ASCII commands (ON, OFF,
+ * UPDATE) keep working on the same topic. tools/app_protocol.py is the host
+ * side of it.
+ */
+#define APP_PROTOCOL_VERSION        1
+#define APP_FRAME_MARK              0x80
+#define APP_FRAME_SIZE              6
+
+typedef enum app_opcode {
+    //host to device, on the control topic
+    APP_OP_OUTPUT = 0x01,   //arg: output (digital_io LED index), value: 0 or 1
+    APP_OP_READ = 0x02,     //new reading, answered by APP_OP_READING
+    //device to host, on the state topic
+    APP_OP_READING = 0x81,  //arg: app_status_t, value: echo width in us
+    APP_OP_ACK = 0x82       //arg: app_status_t, value: opcode acknowledged
+} app_opcode_t;
+
+typedef enum app_status {
+    APP_STATUS_OK = 0,
+    APP_STATUS_BAD_VERSION,
+    APP_STATUS_BAD_LENGTH,
+    APP_STATUS_BAD_OPCODE,
+    APP_STATUS_BAD_ARG,
+    APP_STATUS_NO_DATA      //nothing measured yet
+} app_status_t;
+
+typedef struct app_frame {
+    uint8_t opcode;
+    uint8_t seq;
+    uint8_t arg;
+    uint16_t value;
+} app_frame_t;
+
+//pdTRUE if the payload starts like a frame rather than an ASCII command.
+BaseType_t appFrameIsBinary(const uint8_t *payload, size_t len);
+
+//Decodes a payload. On APP_STATUS_BAD_VERSION and APP_STATUS_BAD_LENGTH
+//only frame->opcode and frame->seq are set, if the payload has them, so
+//the error can still be acknowledged.
+app_status_t appFrameDecode(const uint8_t *payload, size_t len, app_frame_t *frame);
+
+//Encodes a frame into APP_FRAME_SIZE bytes.
+void appFrameEncode(const app_frame_t *frame, uint8_t *payload);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -26,6 +26,8 @@
 #ifndef CORE_MQTT_CONFIG_H
 #define CORE_MQTT_CONFIG_H
 
+#include "mqtt_budget.h"
+
 /**
  * @brief The maximum number of MQTT PUBLISH messages that may be pending
  * acknowledgement at any time.
@@ -36,7 +38,7 @@
  * macro sets the limit on how many simultaneous PUBLISH states an MQTT
  * context maintains.
  */
-#define MQTT_STATE_ARRAY_MAX_COUNT      20U
+#define MQTT_STATE_ARRAY_MAX_COUNT      mqttbudgetSTATE_ARRAY_MAX_COUNT
 
 /**
  * @brief The maximum duration between non-empty network reads while
@@ -55,34 +57,4 @@
  */
 #define MQTT_RECV_POLLING_TIMEOUT_MS    0U
 
-/*********************** coreMQTT Agent Configurations **********************/
-
-/**
- * @brief The maximum number of pending acknowledgments to track for a single
- * connection.
- *
- * @note The MQTT agent tracks MQTT commands (such as PUBLISH and SUBSCRIBE) th
- * at are still waiting to be acknowledged.  MQTT_AGENT_MAX_OUTSTANDING_ACKS set
- * the maximum number of acknowledgments that can be outstanding at any one time.
- * The higher this number is the greater the agent's RAM consumption will be.
- */
-#define MQTT_AGENT_MAX_OUTSTANDING_ACKS         ( 20U )
-
-/**
- * @brief Time in MS that the MQTT agent task will wait in the Blocked state (so
- * not using any CPU time) for a command to arrive in its command queue before
- * exiting the blocked state so it can call MQTT_ProcessLoop().
- *
- * @note It is important MQTT_ProcessLoop() is called often if there is known
- * MQTT traffic, but calling it too often can take processing time away from
- * lower priority tasks and waste CPU time and power.
- */
-#define MQTT_AGENT_MAX_EVENT_QUEUE_WAIT_TIME    ( 1000 )
-
-/**
- * @brief The number of command structures to allocate in the pool
- * for the agent.
- */
-#define MQTT_COMMAND_CONTEXTS_POOL_SIZE         10
-
 #endif /* ifndef CORE_MQTT_CONFIG_H */
@@ -0,0 +1,71 @@
+/*
+ * MIT License
+ * Copyright (c) 2024 Vinicius Silva.  All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ */
+
+#ifndef DRIVERS_EEPROM_LOG_H
+#define DRIVERS_EEPROM_LOG_H
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Append only log of readings in the internal EEPROM.  Records are written
+ * round the whole EEPROM, so every cell wears at the same rate, and carry a
+ * sequence number the log is found again with after a reset.  Writes go
+ * through a small RAM queue emptied by the EE_READY interrupt, an append
+ * never waits for the EEPROM.  When the log is full the oldest record is
+ * overwritten. */
+
+typedef struct xEELOG_RECORD
+{
+	uint16_t usSeq;			/* Sequence number, 15 bits. */
+	uint16_t usTimestamp;	/* Time of the reading, units chosen by the caller. */
+	uint16_t usValue;
+} EELogRecord_t;
+
+/* Finds the log in the EEPROM.  Call once, before the scheduler starts. */
+void vEELogInitialise( void );
+
+/* Queues a record.  Returns pdFALSE, and drops the record, when the previous
+ * one is still being written. */
+BaseType_t xEELogAppend( uint16_t usTimestamp, uint16_t usValue );
+
+/* Number of records not consumed yet. */
+uint8_t ucEELogPending( void );
+
+/* Reads the ucIndex'th record not consumed yet, oldest first.  Waits for
+ * queued writes to finish.  Returns pdFALSE past the last one. */
+BaseType_t xEELogRead( uint8_t ucIndex, EELogRecord_t *pxRecord );
+
+/* Consumes ucRecords records starting at sequence number usFirstSeq, as read
+ * by xEELogRead().  Records the log dropped meanwhile are not counted twice.
+ * The last one is marked in the EEPROM, consumed records are not read again
+ * after a reset. */
+void vEELogConsume( uint16_t usFirstSeq, uint8_t ucRecords );
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
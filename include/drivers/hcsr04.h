@@ -0,0 +1,60 @@
+/*
+ * MIT License
+ * Copyright (c) 2024 Vinicius Silva.  All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ */
+
+#ifndef DRIVERS_HCSR04_H
+#define DRIVERS_HCSR04_H
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* HC-SR04 ultrasonic sensor on Timer 1 input capture.  TRIG is PORTB bit 4
+ * (digital IO 6), ECHO must be wired to ICP1 (PORTB bit 0).  Timer 1 is owned
+ * by this driver, so the tick has to run from another timer (portUSE_TIMER0
+ * or portUSE_TIMER2). */
+
+/* Task notification index used to wake the measuring task.  Shared with
+ * drivers/serial.c, a task never waits on both at once. */
+#define hcsr04NOTIFY_INDEX              ( 1 )
+
+/* Echo widths are in Timer 1 counts of 0.5us. */
+#define hcsr04COUNTS_PER_US             ( 2 )
+
+/* Returned when no echo came back, or when it was longer than Timer 1 can
+ * measure (32.7ms, well past the 4m range of the sensor). */
+#define hcsr04TIMEOUT                   ( ( uint16_t ) 0xffff )
+
+void vHCSR04Initialise( void );
+
+/* Triggers a measurement and blocks the calling task until the falling echo
+ * edge, the hardware timeout, or xBlockTime ticks.  Returns the echo width in
+ * 0.5us counts, or hcsr04TIMEOUT. */
+uint16_t usHCSR04Measure( TickType_t xBlockTime );
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -24,12 +24,29 @@
 #ifndef SERIAL_SERIAL_H
 #define SERIAL_SERIAL_H
 
+#include <stddef.h>
+#include <stdint.h>
+
 #ifdef __cplusplus
 extern "C" {
 #endif
 
+/* Task notification index the driver uses to wake a task blocked on one of
+ * its buffers.  Waiters always re-check the buffer after waking, so other
+ * drivers may share this index. */
+#define serNOTIFY_INDEX                 ( 1 )
+
 typedef void * xComPortHandle;
 
+/* Byte counts since xSerialPortInitMinimal(), see vSerialGetStats().  The
+ * counters wrap around. */
+typedef struct xSERIAL_STATS
+{
+    uint32_t ulRxBytes;         /* Read from the USART, full buffer drops included. */
+    uint32_t ulTxBytes;         /* Sent. */
+    uint16_t usRxDropped;       /* Lost to a full buffer or a USART overrun. */
+} xSerialStats;
+
 typedef enum
 {
     serCOM1,
@@ -103,6 +120,25 @@ signed portBASE_TYPE xSerialGetChar( xComPortHandle pxPort,
 signed portBASE_TYPE xSerialPutChar( xComPortHandle pxPort,
                                      signed char cOutChar,
                                      TickType_t xBlockTime );
+
+/* Block transfers.  xSerialRead waits until xLength bytes were received or
+ * xBlockTime expires, xSerialWrite until all of pvBuffer is queued for Tx or
+ * xBlockTime expires.  Both return the number of bytes actually moved.
+ * xSerialWrite_P takes its data from program memory. */
+size_t xSerialRead( xComPortHandle pxPort,
+                    void * pvBuffer,
+                    size_t xLength,
+                    TickType_t xBlockTime );
+size_t xSerialWrite( xComPortHandle pxPort,
+                     const void * pvBuffer,
+                     size_t xLength,
+                     TickType_t xBlockTime );
+size_t xSerialWrite_P( xComPortHandle pxPort,
+                       const char * pcBuffer,
+                       size_t xLength,
+                       TickType_t xBlockTime );
+void vSerialGetStats( xComPortHandle pxPort,
+                      xSerialStats * pxStats );
 portBASE_TYPE xSerialWaitForSemaphore( xComPortHandle xPort );
 void vSerialClose( xComPortHandle xPort );
 
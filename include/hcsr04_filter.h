@@ -0,0 +1,70 @@
+/*
+ * MIT License
+ * Copyright (c) 2024 Vinicius Silva.  All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ */
+
+#ifndef HCSR04_FILTER_H
+#define HCSR04_FILTER_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include "FreeRTOS.h"
+#include "app_data_types.h"
+
+/* Integer only filter for HC-SR04 readings (us), applied in hcsr04_task
+ * before a sample is stored. Stages run in this order:
+ *  - range check: timeouts (0xffff) and readings outside MIN_US..MAX_US are
+ *    dropped.
+ *  - outlier rejection: readings further than MAX_JUMP_US from the current
+ *    median are dropped, unless REJECT_LIMIT of them come in a row, which is
+ *    then taken as a real step and restarts the filter. 0 disables it.
+ *  - running median over the last MEDIAN_LEN accepted readings, 1 disables it.
+ *  - exponential smoothing, y += (x - y) / 2^EMA_SHIFT. 0 disables it.
+ */
+#define HCSR04_FILTER_MIN_US            116     //2 cm
+#define HCSR04_FILTER_MAX_US            23200   //4 m
+#define HCSR04_FILTER_MAX_JUMP_US       2900    //50 cm between samples
+#define HCSR04_FILTER_REJECT_LIMIT      3
+#define HCSR04_FILTER_MEDIAN_LEN        5
+#define HCSR04_FILTER_EMA_SHIFT         0
+
+typedef struct hcsr04_filter {
+    hcsr04_data_t window[HCSR04_FILTER_MEDIAN_LEN];
+    unsigned char next;         //oldest entry, replaced next
+    unsigned char fill;         //entries in use
+    unsigned char rejected;     //outliers in a row
+    uint32_t ema;               //smoothed value << HCSR04_FILTER_EMA_SHIFT
+} hcsr04_filter_t;
+
+void hcsr04FilterInit(hcsr04_filter_t *filter);
+
+//Feeds a raw reading. Returns pdFALSE when it was dropped, otherwise pdTRUE
+//with the filtered value in *out.
+BaseType_t hcsr04FilterUpdate(hcsr04_filter_t *filter, hcsr04_data_t raw, hcsr04_data_t *out);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
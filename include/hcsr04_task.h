@@ -28,8 +28,33 @@
 extern "C" {
 #endif
 
+#include "app_data_types.h"
+
+/* Sampling rate in Hz. With 0, the task only measures when resumed (UPDATE
+ * command) and notifies mqtt_task. Otherwise it samples periodically into
+ * app_data->samples, rounded to whole ticks. */
+#define HCSR04_SAMPLE_RATE_HZ       20
+
+/* While mqtt_task is offline, one sample per period goes to the EEPROM log
+ * (drivers/eeprom_log.h) and is published once the broker is back. The log
+ * holds 170 records, 170 s at the default. Periodic sampling only. */
+#define HCSR04_LOG_PERIOD_MS        1000
+
+/* Unit of the EEPROM log timestamps. They are 16 bits, so they wrap after
+ * about 11 minutes at 10 ms. */
+#define HCSR04_LOG_TIME_UNIT_MS     10
+
 void hcsr04Task(void *pvParameters);
 
+//Copies the newest sample. Returns pdFALSE if nothing was measured yet.
+BaseType_t hcsr04LatestSample(app_data_handle_t *app_data, hcsr04_sample_t *sample);
+
+//Copies up to max samples newer than *cursor, oldest first, and advances
+//*cursor. Samples already overwritten in the ring are skipped, as long as
+//the reader comes back within 65536 samples (about 54 min at 20 Hz).
+unsigned char hcsr04ReadSamples(app_data_handle_t *app_data, uint16_t *cursor,
+                                hcsr04_sample_t *samples, unsigned char max);
+
 #ifdef __cplusplus
 }
 #endif
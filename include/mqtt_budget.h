@@ -0,0 +1,58 @@
+/*
+ * MIT License
+ * Copyright (c) 2024 Vinicius Silva.  All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ */
+
+#ifndef MQTT_BUDGET_H
+#define MQTT_BUDGET_H
+
+/* Memory budget of the MQTT subsystem. Everything sized by in-flight
+ * messages is derived from the two limits below; core_mqtt_config.h and
+ * mqtt_task.c take their sizes from here. */
+
+/* QoS > 0 PUBLISHes this client may have waiting for an ack. State replies,
+ * one per UPDATE command, and at most one EEPROM backlog batch are sent at
+ * QoS > 0 (telemetry is QoS0). The backlog batch holds its record for a
+ * whole drain, two more stay free for replies. */
+#define mqttbudgetMAX_OUTGOING_INFLIGHT         ( 3U )
+
+/* QoS > 0 PUBLISHes from the broker not completed yet (QoS2 control topic). */
+#define mqttbudgetMAX_INCOMING_INFLIGHT         ( 2U )
+
+/* coreMQTT publish records, one per in-flight message. */
+#define mqttbudgetOUTGOING_PUBLISH_RECORDS      mqttbudgetMAX_OUTGOING_INFLIGHT
+#define mqttbudgetINCOMING_PUBLISH_RECORDS      mqttbudgetMAX_INCOMING_INFLIGHT
+#define mqttbudgetSTATE_ARRAY_MAX_COUNT         ( mqttbudgetOUTGOING_PUBLISH_RECORDS + mqttbudgetINCOMING_PUBLISH_RECORDS )
+
+/* Shared network buffer. Larger incoming PUBLISHes are streamed, see
+ * prvStreamingRecv in mqtt_task.c. */
+#define mqttbudgetNETWORK_BUFFER_SIZE           ( 32U )
+
+/* Upper limit for the static RAM (.data + .bss + .rodata) of mqtt_task.c,
+ * checked against mqtt_task.o by "make ramcheck". About 315 bytes are used
+ * with the settings above: 170 of variables and 145 of topic, broker and
+ * client identifier strings plus xTopicQoS, which the linker copies into SRAM.
+ * Tables marked PROGMEM stay in flash and do not count. */
+#ifndef mqttbudgetSTATIC_RAM_BYTES
+    #define mqttbudgetSTATIC_RAM_BYTES          ( 352U )
+#endif
+
+#endif /* MQTT_BUDGET_H */
@@ -0,0 +1,67 @@
+/*
+ * MIT License
+ * Copyright (c) 2024 Vinicius Silva.  All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ */
+
+#ifndef RUNTIME_STATS_H
+#define RUNTIME_STATS_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stddef.h>
+#include <stdint.h>
+#include "FreeRTOS.h"
+#include "task.h"
+
+/* Diagnostics record, published by mqtt_task. Multi-byte fields little
+ * endian:
+ *
+ *   uint8_t  version      RUNTIME_STATS_VERSION
+ *   uint8_t  tasks        number of task entries
+ *   uint16_t period_ms    time the CPU shares cover, since the last record
+ *   tasks times:
+ *     char     name       first character of the task name
+ *     uint8_t  cpu        share of the period, 0.5% units (200 = 100%)
+ *     uint16_t stack      stack high-water mark, bytes never used
+ *   uint32_t rx_bytes     USART bytes received since boot
+ *   uint32_t tx_bytes     USART bytes sent since boot
+ *   uint16_t rx_dropped   USART bytes lost since boot
+ *
+ * CPU time comes from the FreeRTOS run time counters (configGENERATE_RUN_TIME_STATS,
+ * ulPortGetTimeUs() in the port). The idle task share is what is left for
+ * sleeping; a task near 200 or a stack near 0 is the warning sign.
+ */
+#define RUNTIME_STATS_VERSION           1
+#define RUNTIME_STATS_MAX_TASKS         4
+#define RUNTIME_STATS_RECORD_SIZE(tasks)    (4 + (tasks) * 4 + 10)
+
+//Fills record (RUNTIME_STATS_RECORD_SIZE(count) bytes) for the period since
+//the previous call, since boot on the first one. Up to RUNTIME_STATS_MAX_TASKS
+//tasks, in the order given. Returns the record size.
+size_t runtimeStatsRecord(const TaskHandle_t *tasks, unsigned char count, uint8_t *record);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
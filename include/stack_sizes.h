@@ -0,0 +1,27 @@
+/* Hand-written until the first profiling run: tools/stack_sizes.py generate
+ * then replaces this file, see doc/stack_sizing.txt. Keep the layout so the
+ * profiling sizes match the tool's. The sizes below have no interrupt margin,
+ * the stack overflow check (FreeRTOSConfig.h) catches a task that runs out.
+ *
+ * Task stacks in bytes, the old hand sizes (minimal size + padding). */
+
+#ifndef STACK_SIZES_H
+#define STACK_SIZES_H
+
+#ifdef STACK_PROFILE
+
+#define STACK_SIZE_MQTT     440
+#define STACK_SIZE_HCSR04   128
+#define STACK_SIZE_8266     128
+#define STACK_SIZE_IDLE     112
+
+#else
+
+#define STACK_SIZE_MQTT     (380 + 8)
+#define STACK_SIZE_HCSR04   (72 + 8)
+#define STACK_SIZE_8266     (80 + 8)
+#define STACK_SIZE_IDLE     (72 + 8)
+
+#endif
+
+#endif
@@ -31,6 +31,13 @@ extern "C" {
 
 #include "transport_interface.h"
 #include "FreeRTOS.h"
+#include "task.h"
+#include "stack_sizes.h"
+
+/* To keep the ESP8266 in passthrough mode (AT+CIPMODE=1) while connected,
+ * define ESP8266_PASSTHROUGH macro below. Send and recv are then raw byte
+ * pipes, with no AT+CIPSEND handshake or +IPD framing per packet. */
+/* #define ESP8266_PASSTHROUGH */
 
 typedef enum esp8266TransportStatus {
     ESP8266_TRANSPORT_SUCCESS = 1,           /**< Function successfully completed. */
@@ -38,12 +45,26 @@ typedef enum esp8266TransportStatus {
     ESP8266_TRANSPORT_CONNECT_FAILURE = 3    /**< Initial connection to the server failed. */
 } esp8266TransportStatus_t;
 
-BaseType_t esp8266Initialise(configSTACK_DEPTH_TYPE stackSize, void *pvParameter, UBaseType_t priority);
+//Stack of the receive task, it is allocated statically by the transport.
+#define ESP8266_RX_STACK_SIZE       STACK_SIZE_8266
+
+void esp8266Initialise(void *pvParameter, UBaseType_t priority);
 
 //pHostName must be the target ipv4 address, port is the TCP target port number.
 esp8266TransportStatus_t esp8266AT_Connect(const char *pHostName, const char *port);
 esp8266TransportStatus_t esp8266AT_Disconnect(void);
 
+//Sets bits (eSetBits, notification index 0) in task every time a complete
+//+IPD payload, or a passthrough chunk, lands in the receive buffer.
+//NULL stops the notifications.
+void esp8266AT_SetRxNotify(TaskHandle_t task, uint32_t bits);
+
+//Bytes already received and waiting for esp8266AT_recv.
+size_t esp8266AT_Available(void);
+
+//Handle of the receive task, for the run time statistics.
+TaskHandle_t esp8266AT_RxTask(void);
+
 int32_t esp8266AT_recv(NetworkContext_t *pNetworkContext,
                         void *pBuffer,
                         size_t bytesToRecv);
@@ -52,6 +73,11 @@ int32_t esp8266AT_send(NetworkContext_t *pNetworkContext,
                         const void *pBuffer,
                         size_t bytesToSend);
 
+//Sends the vectors back to back, one AT+CIPSEND per 2048 bytes of total length.
+int32_t esp8266AT_writev(NetworkContext_t *pNetworkContext,
+                        TransportOutVector_t *pIoVec,
+                        size_t ioVecCount);
+
 
 #ifdef __cplusplus
 }
@@ -48,12 +48,27 @@
 /* Start tasks with interrupts enables. */
 #define portFLAGS_INT_ENABLED                   ( ( StackType_t ) 0x80 )
 
-/* Hardware constants for timer 1. */
-#define portCLEAR_COUNTER_ON_MATCH              ( ( uint8_t ) 0x08 )
-#define portPRESCALE_64                         ( ( uint8_t ) 0x03 )
-#define portCLOCK_PRESCALER                     ( ( uint32_t ) 64 )
+/* Hardware constants for the tick timer, see portmacro.h for the registers. */
 #define portCOMPARE_MATCH_A_INTERRUPT_ENABLE    ( ( uint8_t ) 0x02 )
 
+#if defined( portUSE_TIMER1 )
+    _Static_assert( portTICK_COMPARE_MATCH <= 0xffffUL, "configTICK_RATE_HZ too low for timer 1 with a prescaler of 64" );
+#else
+    _Static_assert( portTICK_COMPARE_MATCH <= 0xffUL, "configTICK_RATE_HZ too low for an 8 bit tick timer with a prescaler of 1024" );
+#endif
+
+_Static_assert( ( 1000000UL * portTICK_PRESCALER ) % configCPU_CLOCK_HZ == 0, "configCPU_CLOCK_HZ must give whole microseconds per tick timer count" );
+_Static_assert( 2 * portTICK_PERIOD_US + 1000 <= 0xffffUL, "tick period too long for ulPortGetTimeMs()" );
+
+/*-----------------------------------------------------------*/
+
+/* Time at the last tick, kept by prvClockTick().  The tick period is a whole
+ * number of timer counts, not always of milliseconds (9984us with Timer 2 at
+ * 100Hz), so the sub-millisecond part is carried separately. */
+static volatile uint32_t ulClockMs = 0;
+static volatile uint32_t ulClockUs = 0;
+static volatile uint16_t usClockUsFraction = 0;
+
 /*-----------------------------------------------------------*/
 
 /* We require the address of the pxCurrentTCB variable, but don't want to know
@@ -124,6 +139,53 @@ extern volatile TCB_t * volatile pxCurrentTCB;
                    "st     x+, r0                  \n\t" \
                    );
 
+/*
+ * portSAVE_CONTEXT() for a context left through a function call.  The caller
+ * does not expect r0, r18-r27, r30 and r31 to survive the call, so their
+ * slots are skipped by moving the stack pointer instead of being pushed.  The
+ * frame has the same layout, portRESTORE_CONTEXT() pops whatever is in them.
+ */
+
+#define portSAVE_CALL_SAVED_CONTEXT()                    \
+    asm volatile ( "in     r0, __SREG__            \n\t" \
+                   "cli                            \n\t" \
+                   "push   r0                      \n\t" \
+                   "push   r0                      \n\t" \
+                   "push   r1                      \n\t" \
+                   "clr    r1                      \n\t" \
+                   "push   r2                      \n\t" \
+                   "push   r3                      \n\t" \
+                   "push   r4                      \n\t" \
+                   "push   r5                      \n\t" \
+                   "push   r6                      \n\t" \
+                   "push   r7                      \n\t" \
+                   "push   r8                      \n\t" \
+                   "push   r9                      \n\t" \
+                   "push   r10                     \n\t" \
+                   "push   r11                     \n\t" \
+                   "push   r12                     \n\t" \
+                   "push   r13                     \n\t" \
+                   "push   r14                     \n\t" \
+                   "push   r15                     \n\t" \
+                   "push   r16                     \n\t" \
+                   "push   r17                     \n\t" \
+                   "in     r26, __SP_L__           \n\t" \
+                   "in     r27, __SP_H__           \n\t" \
+                   "sbiw   r26, 10                 \n\t" \
+                   "out    __SP_H__, r27           \n\t" \
+                   "out    __SP_L__, r26           \n\t" \
+                   "push   r28                     \n\t" \
+                   "push   r29                     \n\t" \
+                   "push   r30                     \n\t" \
+                   "push   r31                     \n\t" \
+                   "lds    r26, pxCurrentTCB       \n\t" \
+                   "lds    r27, pxCurrentTCB + 1   \n\t" \
+                   "in     r0, 0x3d                \n\t" \
+                   "st     x+, r0                  \n\t" \
+                   "in     r0, 0x3e                \n\t" \
+                   "st     x+, r0                  \n\t" \
+                   );
+
 /*
  * Opposite to portSAVE_CONTEXT().  Interrupts will have been disabled during
  * the context save so we can write to the stack pointer.
@@ -178,6 +240,12 @@ extern volatile TCB_t * volatile pxCurrentTCB;
  * Perform hardware setup to enable ticks from timer 1, compare match A.
  */
 static void prvSetupTimerInterrupt( void );
+
+/*
+ * Read the time at the last tick and the microseconds since then, with a
+ * tick that is pending but not yet counted included in the latter.
+ */
+static uint16_t prvClockRead( uint32_t * pulMs, uint32_t * pulUs, uint16_t * pusFraction );
 /*-----------------------------------------------------------*/
 
 /*
@@ -331,7 +399,11 @@ void vPortEndScheduler( void )
 void vPortYield( void ) __attribute__( ( naked ) );
 void vPortYield( void )
 {
-    portSAVE_CONTEXT();
+    #if defined( portLEAN_YIELD )
+        portSAVE_CALL_SAVED_CONTEXT();
+    #else
+        portSAVE_CONTEXT();
+    #endif
     vTaskSwitchContext();
     portRESTORE_CONTEXT();
 
@@ -340,78 +412,89 @@ void vPortYield( void )
 /*-----------------------------------------------------------*/
 
 /*
- * Context switch function used by the tick.  This must be identical to
- * vPortYield() from the call to vTaskSwitchContext() onwards.  The only
- * difference from vPortYield() is the tick count is incremented as the
- * call comes from the tick ISR.
+ * Advance the clock by one tick, called from the tick interrupt.
  */
-void vPortYieldFromTick( void ) __attribute__( ( naked ) );
-void vPortYieldFromTick( void )
+static inline __attribute__( ( always_inline ) ) void prvClockTick( void )
 {
-    portSAVE_CONTEXT();
+    uint16_t usFraction = usClockUsFraction + ( uint16_t ) ( portTICK_PERIOD_US % 1000 );
+
+    ulClockUs += portTICK_PERIOD_US;
+    ulClockMs += portTICK_PERIOD_US / 1000;
 
-    if( xTaskIncrementTick() != pdFALSE )
+    if( usFraction >= 1000 )
     {
-        vTaskSwitchContext();
+        usFraction -= 1000;
+        ulClockMs++;
     }
 
-    portRESTORE_CONTEXT();
-
-    asm volatile ( "ret" );
+    usClockUsFraction = usFraction;
 }
 /*-----------------------------------------------------------*/
 
+
 /*
- * Setup timer 1 compare match A to generate a tick interrupt.
+ * Setup compare match A of the tick timer to generate a tick interrupt.
  */
 static void prvSetupTimerInterrupt( void )
 {
-    uint32_t ulCompareMatch;
-    uint8_t ucHighByte, ucLowByte;
-
-    /* Using 16bit timer 1 to generate the tick.  Correct fuses must be
-     * selected for the configCPU_CLOCK_HZ clock. */
-
-    ulCompareMatch = configCPU_CLOCK_HZ / configTICK_RATE_HZ;
+    uint8_t ucLowByte;
 
-    /* We only have 16 bits so have to scale to get our required tick rate. */
-    ulCompareMatch /= portCLOCK_PRESCALER;
-
-    /* Adjust for correct value. */
-    ulCompareMatch -= ( uint32_t ) 1;
-
-    /* Setup compare match value for compare match A.  Interrupts are disabled
-     * before this is called so we need not worry here. */
-    ucLowByte = ( uint8_t ) ( ulCompareMatch & ( uint32_t ) 0xff );
-    ulCompareMatch >>= 8;
-    ucHighByte = ( uint8_t ) ( ulCompareMatch & ( uint32_t ) 0xff );
-    OCR1AH = ucHighByte;
-    OCR1AL = ucLowByte;
-
-    /* Setup clock source and compare match behaviour. */
-    ucLowByte = portCLEAR_COUNTER_ON_MATCH | portPRESCALE_64;
-    TCCR1B = ucLowByte;
+    /* Correct fuses must be selected for the configCPU_CLOCK_HZ clock.  The
+     * counter is cleared on compare match so the period is the compare value
+     * plus one. */
+    #if defined( portUSE_TIMER1 )
+    {
+        uint32_t ulCompareMatch = portTICK_COMPARE_MATCH;
+        uint8_t ucHighByte;
+
+        /* Setup compare match value for compare match A.  Interrupts are
+         * disabled before this is called so we need not worry here. */
+        ucLowByte = ( uint8_t ) ( ulCompareMatch & ( uint32_t ) 0xff );
+        ulCompareMatch >>= 8;
+        ucHighByte = ( uint8_t ) ( ulCompareMatch & ( uint32_t ) 0xff );
+        OCR1AH = ucHighByte;
+        OCR1AL = ucLowByte;
+
+        /* Setup clock source and compare match behaviour. */
+        ucLowByte = portTICK_CTC_B | portTICK_PRESCALE_BITS;
+        TCCR1B = ucLowByte;
+    }
+    #else
+    {
+        /* 8 bit timer 0 or 2, WGM bits for CTC are in control register A. */
+        portTICK_OCRA = ( uint8_t ) portTICK_COMPARE_MATCH;
+        portTICK_TCNT = 0;
+        portTICK_TCCRA = portTICK_CTC_A;
+        portTICK_TCCRB = portTICK_PRESCALE_BITS;
+    }
+    #endif
 
     /* Enable the interrupt - this is okay as interrupt are currently globally
      * disabled. */
-    ucLowByte = TIMSK1;
+    ucLowByte = portTICK_TIMSK;
     ucLowByte |= portCOMPARE_MATCH_A_INTERRUPT_ENABLE;
-    TIMSK1 = ucLowByte;
+    portTICK_TIMSK = ucLowByte;
 }
 /*-----------------------------------------------------------*/
 
 #if configUSE_PREEMPTION == 1
 
 /*
- * Tick ISR for preemptive scheduler.  We can use a naked attribute as
- * the context is saved at the start of vPortYieldFromTick().  The tick
- * count is incremented after the context is saved.
+ * Tick ISR for preemptive scheduler.  Most ticks switch nothing, so the ISR
+ * only saves what the compiler needs for the calls, and the task context is
+ * saved by vPortYield() when xTaskIncrementTick() asks for a switch.  The
+ * task then resumes inside this ISR, like after a taskYIELD() from the
+ * serial or HC-SR04 interrupts.
  */
-    void TIMER1_COMPA_vect( void ) __attribute__( ( signal, naked ) );
-    void TIMER1_COMPA_vect( void )
+    void portSCHEDULER_ISR( void ) __attribute__( ( signal ) );
+    void portSCHEDULER_ISR( void )
     {
-        vPortYieldFromTick();
-        asm volatile ( "reti" );
+        prvClockTick();
+
+        if( xTaskIncrementTick() != pdFALSE )
+        {
+            vPortYield();
+        }
     }
 #else
 
@@ -420,9 +503,57 @@ static void prvSetupTimerInterrupt( void )
  * tick count.  We don't need to switch context, this can only be done by
  * manual calls to taskYIELD();
  */
-    void TIMER1_COMPA_vect( void ) __attribute__( ( signal ) );
-    void TIMER1_COMPA_vect( void )
+    void portSCHEDULER_ISR( void ) __attribute__( ( signal ) );
+    void portSCHEDULER_ISR( void )
     {
+        prvClockTick();
         xTaskIncrementTick();
     }
 #endif /* if configUSE_PREEMPTION == 1 */
+/*-----------------------------------------------------------*/
+
+static uint16_t prvClockRead( uint32_t * pulMs, uint32_t * pulUs, uint16_t * pusFraction )
+{
+    uint16_t usCount;
+    uint8_t ucPending;
+
+    portENTER_CRITICAL();
+    {
+        usCount = portTICK_TCNT;
+        ucPending = portTICK_TIFR & portCOMPARE_MATCH_A_FLAG;
+        *pulMs = ulClockMs;
+        *pulUs = ulClockUs;
+        *pusFraction = usClockUsFraction;
+    }
+    portEXIT_CRITICAL();
+
+    /* The counter was cleared by a compare match while interrupts were off.
+     * A count from before the match is close to the compare value. */
+    if( ( ucPending != 0 ) && ( usCount < ( portTICK_COMPARE_MATCH / 2 ) ) )
+    {
+        usCount += portTICK_COMPARE_MATCH + 1;
+    }
+
+    return ( uint16_t ) ( usCount * portTIMER_COUNT_US );
+}
+/*-----------------------------------------------------------*/
+
+uint32_t ulPortGetTimeMs( void )
+{
+    uint32_t ulMs, ulUs;
+    uint16_t usFraction;
+    uint16_t usElapsedUs = prvClockRead( &ulMs, &ulUs, &usFraction );
+
+    return ulMs + ( uint16_t ) ( usFraction + usElapsedUs ) / 1000;
+}
+/*-----------------------------------------------------------*/
+
+uint32_t ulPortGetTimeUs( void )
+{
+    uint32_t ulMs, ulUs;
+    uint16_t usFraction;
+    uint16_t usElapsedUs = prvClockRead( &ulMs, &ulUs, &usFraction );
+
+    return ulUs + usElapsedUs;
+}
+/*-----------------------------------------------------------*/
@@ -99,6 +99,68 @@ typedef unsigned char    UBaseType_t;
 #define portNOP()    asm volatile ( "nop" );
 /*-----------------------------------------------------------*/
 
+/* Tick timer.  Timer 1 is used unless portUSE_TIMER0 or portUSE_TIMER2 is
+ * defined in FreeRTOSConfig.h.  The 8 bit timers run in CTC mode with a
+ * prescaler of 1024, leaving Timer 1 (and its input capture unit) to the
+ * application.  The register names below are only usable where <avr/io.h> is
+ * included. */
+#if defined( portUSE_TIMER0 )
+    #define portTICK_TCCRA                    TCCR0A
+    #define portTICK_TCCRB                    TCCR0B
+    #define portTICK_TCNT                     TCNT0
+    #define portTICK_OCRA                     OCR0A
+    #define portTICK_TIMSK                    TIMSK0
+    #define portTICK_TIFR                     TIFR0
+    #define portTICK_CTC_A                    ( ( uint8_t ) 0x02 ) /* WGM01 */
+    #define portTICK_PRESCALE_BITS            ( ( uint8_t ) 0x05 ) /* clk/1024 */
+    #define portTICK_PRESCALER                ( ( uint32_t ) 1024 )
+    #define portSCHEDULER_ISR                 TIMER0_COMPA_vect
+#elif defined( portUSE_TIMER2 )
+    #define portTICK_TCCRA                    TCCR2A
+    #define portTICK_TCCRB                    TCCR2B
+    #define portTICK_TCNT                     TCNT2
+    #define portTICK_OCRA                     OCR2A
+    #define portTICK_TIMSK                    TIMSK2
+    #define portTICK_TIFR                     TIFR2
+    #define portTICK_CTC_A                    ( ( uint8_t ) 0x02 ) /* WGM21 */
+    #define portTICK_PRESCALE_BITS            ( ( uint8_t ) 0x07 ) /* clk/1024 */
+    #define portTICK_PRESCALER                ( ( uint32_t ) 1024 )
+    #define portSCHEDULER_ISR                 TIMER2_COMPA_vect
+#else
+    #define portUSE_TIMER1
+    #define portTICK_TCCRB                    TCCR1B
+    #define portTICK_TCNT                     TCNT1
+    #define portTICK_OCRA                     OCR1A
+    #define portTICK_TIMSK                    TIMSK1
+    #define portTICK_TIFR                     TIFR1
+    #define portTICK_CTC_B                    ( ( uint8_t ) 0x08 ) /* WGM12 */
+    #define portTICK_PRESCALE_BITS            ( ( uint8_t ) 0x03 ) /* clk/64 */
+    #define portTICK_PRESCALER                ( ( uint32_t ) 64 )
+    #define portSCHEDULER_ISR                 TIMER1_COMPA_vect
+#endif
+
+#define portTICK_COMPARE_MATCH                ( ( configCPU_CLOCK_HZ / configTICK_RATE_HZ ) / portTICK_PRESCALER - 1 )
+#define portCOMPARE_MATCH_A_FLAG              ( ( uint8_t ) 0x02 ) /* OCFxA, same bit in all three timers */
+/*-----------------------------------------------------------*/
+
+/* Monotonic clock from the tick count and the tick timer counter, see port.c.
+ * The resolution is one timer count, 64us with the 8 bit timers and 4us with
+ * Timer 1 at 16MHz.  Both wrap around, compare times by subtraction:
+ * milliseconds after 49.7 days, microseconds after 71.6 minutes. */
+#define portTIMER_COUNT_US                    ( ( uint32_t ) ( 1000000UL * portTICK_PRESCALER / configCPU_CLOCK_HZ ) )
+#define portTICK_PERIOD_US                    ( ( uint32_t ) ( portTICK_COMPARE_MATCH + 1 ) * portTIMER_COUNT_US )
+
+extern uint32_t ulPortGetTimeMs( void );
+extern uint32_t ulPortGetTimeUs( void );
+
+/* The run time stats counter is the microsecond clock, it needs no timer of
+ * its own. */
+#if ( configGENERATE_RUN_TIME_STATS == 1 )
+    #define portCONFIGURE_TIMER_FOR_RUN_TIME_STATS()
+    #define portGET_RUN_TIME_COUNTER_VALUE()    ulPortGetTimeUs()
+#endif
+/*-----------------------------------------------------------*/
+
 /* Kernel utilities. */
 extern void vPortYield( void ) __attribute__( ( naked ) );
 #define portYIELD()    vPortYield()
@@ -0,0 +1,65 @@
+/*
+ * MIT License
+ * Copyright (c) 2024 Vinicius Silva.  All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ */
+
+#include <string.h>
+#include "app_protocol.h"
+
+BaseType_t appFrameIsBinary(const uint8_t *payload, size_t len) {
+    return len && (payload[0] & APP_FRAME_MARK) ? pdTRUE : pdFALSE;
+}
+/*-----------------------------------------------------------*/
+
+app_status_t appFrameDecode(const uint8_t *payload, size_t len, app_frame_t *frame) {
+
+    memset(frame, 0, sizeof(*frame));
+
+    //Mark, opcode and seq keep their place in every version
+    if (len > 1) {
+        frame->opcode = payload[1];
+    }
+    if (len > 2) {
+        frame->seq = payload[2];
+    }
+
+    if (!len || payload[0] != (APP_FRAME_MARK | APP_PROTOCOL_VERSION)) {
+        return APP_STATUS_BAD_VERSION;
+    }
+    if (len != APP_FRAME_SIZE) {
+        return APP_STATUS_BAD_LENGTH;
+    }
+
+    frame->arg = payload[3];
+    frame->value = (uint16_t) (payload[4] | (payload[5] << 8));
+    return APP_STATUS_OK;
+}
+/*-----------------------------------------------------------*/
+
+void appFrameEncode(const app_frame_t *frame, uint8_t *payload) {
+
+    payload[0] = APP_FRAME_MARK | APP_PROTOCOL_VERSION;
+    payload[1] = frame->opcode;
+    payload[2] = frame->seq;
+    payload[3] = frame->arg;
+    payload[4] = (uint8_t) frame->value;
+    payload[5] = (uint8_t) (frame->value >> 8);
+}
@@ -0,0 +1,337 @@
+/*
+ * MIT License
+ * Copyright (c) 2024 Vinicius Silva.  All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ */
+
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include "FreeRTOS.h"
+#include "task.h"
+#include "drivers/eeprom_log.h"
+
+/*-----------------------------------------------------------
+ * Wear levelled log in the internal EEPROM.
+ *
+ * The EEPROM is an array of eelogSLOTS records of 6 bytes: timestamp, value
+ * and sequence number, little endian, the sequence number last so that a
+ * record torn by a reset still carries its old one.  Bit 15 of the sequence
+ * number is set while the record is pending and cleared, write only, on the
+ * last record of every consumed batch.  Erased cells read 0xff, so 0x7fff is
+ * never used as a sequence number.
+ *
+ * Byte writes are queued in RAM.  The EE_READY interrupt starts the next one
+ * each time the EEPROM is ready, skipping bytes that already hold the value
+ * and using the shorter write only or erase only modes when they do.
+ *-----------------------------------------------------------*/
+
+#define eelogRECORD_SIZE				( 6U )
+#define eelogSLOTS						( ( uint8_t ) ( ( E2END + 1UL ) / eelogRECORD_SIZE ) )
+#define eelogSEQ_OFFSET					( 4U )
+#define eelogSEQ_MOD					( 0x7fffU )
+#define eelogPENDING					( 0x8000U )
+#define eelogERASED						( 0xffffU )
+
+/* Queued byte writes, a power of two.  Holds one record plus the mark of a
+ * consumed batch. */
+#define eelogOPS_LEN					( 8U )
+
+_Static_assert( ( E2END + 1UL ) / eelogRECORD_SIZE <= 255U, "eelogSLOTS must fit a uint8_t" );
+_Static_assert( eelogOPS_LEN > eelogRECORD_SIZE, "eelogOPS_LEN must hold a record and a mark" );
+
+static uint16_t usOpsAddress[ eelogOPS_LEN ];
+static uint8_t ucOpsData[ eelogOPS_LEN ];
+static volatile uint8_t ucOpsHead;
+static volatile uint8_t ucOpsTail;
+
+/* Slot written next, oldest pending slot, pending records, and the sequence
+ * number of the next record.  Only changed inside critical sections. */
+static uint8_t ucHead;
+static uint8_t ucTail;
+static uint8_t ucCount;
+static uint16_t usNextSeq;
+
+static uint16_t prvReadWord( uint16_t usAddress );
+static uint16_t prvSlotSeq( uint8_t ucSlot );
+static void prvQueueByte( uint16_t usAddress, uint8_t ucData );
+static uint8_t prvNextSlot( uint8_t ucSlot );
+/*-----------------------------------------------------------*/
+
+void vEELogInitialise( void )
+{
+uint8_t ucSlot;
+uint8_t ucOldest;
+uint16_t usSeq;
+BaseType_t xConsumed = pdFALSE;
+
+	ucHead = 0;
+	ucTail = 0;
+	ucCount = 0;
+	usNextSeq = 0;
+
+	if( prvSlotSeq( 0 ) == eelogERASED )
+	{
+		/* Empty log. */
+		return;
+	}
+
+	/* The sequence numbers run on from slot to slot, up to the newest
+	record.  The slot after it is erased or holds the oldest one. */
+	for( ucSlot = 0; ucSlot < eelogSLOTS - 1U; ucSlot++ )
+	{
+		usSeq = ( uint16_t ) ( ( ( prvSlotSeq( ucSlot ) & eelogSEQ_MOD ) + 1U ) % eelogSEQ_MOD );
+		if( ( prvSlotSeq( ucSlot + 1U ) & eelogSEQ_MOD ) != usSeq )
+		{
+			break;
+		}
+	}
+
+	ucHead = prvNextSlot( ucSlot );
+	usNextSeq = ( uint16_t ) ( ( ( prvSlotSeq( ucSlot ) & eelogSEQ_MOD ) + 1U ) % eelogSEQ_MOD );
+	ucOldest = ( prvSlotSeq( ucHead ) == eelogERASED ) ? 0U : ucHead;
+
+	/* Everything after the newest consumed mark is still pending. */
+	ucTail = ucOldest;
+	ucSlot = ucOldest;
+	do
+	{
+		usSeq = prvSlotSeq( ucSlot );
+		ucSlot = prvNextSlot( ucSlot );
+		if( !( usSeq & eelogPENDING ) )
+		{
+			ucTail = ucSlot;
+			xConsumed = pdTRUE;
+		}
+	} while( ucSlot != ucHead );
+
+	ucCount = ( uint8_t ) ( ( ucHead + eelogSLOTS - ucTail ) % eelogSLOTS );
+	if( ( ucCount == 0U ) && ( ucOldest == ucHead ) && ( xConsumed == pdFALSE ) )
+	{
+		/* Full, and nothing consumed. */
+		ucCount = eelogSLOTS;
+	}
+}
+/*-----------------------------------------------------------*/
+
+BaseType_t xEELogAppend( uint16_t usTimestamp, uint16_t usValue )
+{
+BaseType_t xReturn = pdFALSE;
+uint16_t usAddress;
+uint16_t usSeq;
+
+	portENTER_CRITICAL();
+	{
+		if( ( uint8_t ) ( eelogOPS_LEN - ( uint8_t ) ( ucOpsHead - ucOpsTail ) ) >= eelogRECORD_SIZE )
+		{
+			usAddress = ( uint16_t ) ucHead * eelogRECORD_SIZE;
+			usSeq = usNextSeq | eelogPENDING;
+
+			prvQueueByte( usAddress, ( uint8_t ) usTimestamp );
+			prvQueueByte( usAddress + 1U, ( uint8_t ) ( usTimestamp >> 8 ) );
+			prvQueueByte( usAddress + 2U, ( uint8_t ) usValue );
+			prvQueueByte( usAddress + 3U, ( uint8_t ) ( usValue >> 8 ) );
+			prvQueueByte( usAddress + 4U, ( uint8_t ) usSeq );
+			prvQueueByte( usAddress + 5U, ( uint8_t ) ( usSeq >> 8 ) );
+
+			ucHead = prvNextSlot( ucHead );
+			usNextSeq = ( uint16_t ) ( ( usNextSeq + 1U ) % eelogSEQ_MOD );
+			if( ucCount == eelogSLOTS )
+			{
+				/* The oldest pending record has just been overwritten. */
+				ucTail = prvNextSlot( ucTail );
+			}
+			else
+			{
+				ucCount++;
+			}
+
+			EECR |= _BV( EERIE );
+			xReturn = pdPASS;
+		}
+	}
+	portEXIT_CRITICAL();
+
+	return xReturn;
+}
+/*-----------------------------------------------------------*/
+
+uint8_t ucEELogPending( void )
+{
+	return ucCount;
+}
+/*-----------------------------------------------------------*/
+
+BaseType_t xEELogRead( uint8_t ucIndex, EELogRecord_t *pxRecord )
+{
+BaseType_t xReturn = pdFALSE;
+uint16_t usAddress;
+
+	/* The EEPROM cannot be read while it is being written, and a queued
+	record is not there yet. */
+	for( ;; )
+	{
+		portENTER_CRITICAL();
+		if( ( ucOpsHead == ucOpsTail ) && !( EECR & _BV( EEPE ) ) )
+		{
+			break;
+		}
+		portEXIT_CRITICAL();
+		vTaskDelay( 1 );
+	}
+
+	if( ucIndex < ucCount )
+	{
+		usAddress = ( uint16_t ) ( ( ucTail + ucIndex ) % eelogSLOTS ) * eelogRECORD_SIZE;
+		pxRecord->usTimestamp = prvReadWord( usAddress );
+		pxRecord->usValue = prvReadWord( usAddress + 2U );
+		pxRecord->usSeq = prvReadWord( usAddress + eelogSEQ_OFFSET ) & eelogSEQ_MOD;
+		xReturn = pdPASS;
+	}
+	portEXIT_CRITICAL();
+
+	return xReturn;
+}
+/*-----------------------------------------------------------*/
+
+void vEELogConsume( uint16_t usFirstSeq, uint8_t ucRecords )
+{
+uint16_t usTailSeq;
+uint16_t usDone;
+uint16_t usLastSeq;
+uint8_t ucLast;
+
+	portENTER_CRITICAL();
+	{
+		/* Records dropped since they were read are already gone. */
+		usTailSeq = ( uint16_t ) ( ( usNextSeq + eelogSEQ_MOD - ucCount ) % eelogSEQ_MOD );
+		usDone = ( uint16_t ) ( ( usFirstSeq + ucRecords + eelogSEQ_MOD - usTailSeq ) % eelogSEQ_MOD );
+		if( usDone > ( eelogSEQ_MOD / 2U ) )
+		{
+			/* The whole batch was dropped. */
+			usDone = 0U;
+		}
+		else if( usDone > ucCount )
+		{
+			usDone = ucCount;
+		}
+
+		if( usDone > 0U )
+		{
+			ucLast = ( uint8_t ) ( ( ucTail + usDone - 1U ) % eelogSLOTS );
+			usLastSeq = ( uint16_t ) ( ( usTailSeq + usDone - 1U ) % eelogSEQ_MOD );
+			ucTail = ( uint8_t ) ( ( ucTail + usDone ) % eelogSLOTS );
+			ucCount -= ( uint8_t ) usDone;
+
+			/* Clearing the pending bit only takes a write only cycle.
+			Without room in the queue the batch is read again after a
+			reset, not lost. */
+			if( ( uint8_t ) ( ucOpsHead - ucOpsTail ) < eelogOPS_LEN )
+			{
+				prvQueueByte( ( uint16_t ) ucLast * eelogRECORD_SIZE + eelogSEQ_OFFSET + 1U, ( uint8_t ) ( usLastSeq >> 8 ) );
+				EECR |= _BV( EERIE );
+			}
+		}
+	}
+	portEXIT_CRITICAL();
+}
+/*-----------------------------------------------------------*/
+
+static uint16_t prvReadWord( uint16_t usAddress )
+{
+uint16_t usWord;
+
+	/* Called with the EEPROM idle and interrupts disabled. */
+	EEAR = usAddress;
+	EECR |= _BV( EERE );
+	usWord = EEDR;
+	EEAR = usAddress + 1U;
+	EECR |= _BV( EERE );
+	usWord |= ( uint16_t ) EEDR << 8;
+
+	return usWord;
+}
+/*-----------------------------------------------------------*/
+
+static uint16_t prvSlotSeq( uint8_t ucSlot )
+{
+	return prvReadWord( ( uint16_t ) ucSlot * eelogRECORD_SIZE + eelogSEQ_OFFSET );
+}
+/*-----------------------------------------------------------*/
+
+static void prvQueueByte( uint16_t usAddress, uint8_t ucData )
+{
+	/* Called with interrupts disabled and room in the queue. */
+	usOpsAddress[ ucOpsHead & ( eelogOPS_LEN - 1U ) ] = usAddress;
+	ucOpsData[ ucOpsHead & ( eelogOPS_LEN - 1U ) ] = ucData;
+	ucOpsHead++;
+}
+/*-----------------------------------------------------------*/
+
+static uint8_t prvNextSlot( uint8_t ucSlot )
+{
+	return ( ucSlot + 1U < eelogSLOTS ) ? ( uint8_t ) ( ucSlot + 1U ) : 0U;
+}
+/*-----------------------------------------------------------*/
+
+SIGNAL( EE_READY_vect )
+{
+uint8_t ucOld;
+uint8_t ucNew;
+uint8_t ucTail;
+
+	while( ucOpsHead != ucOpsTail )
+	{
+		ucTail = ucOpsTail;
+		EEAR = usOpsAddress[ ucTail & ( eelogOPS_LEN - 1U ) ];
+		ucNew = ucOpsData[ ucTail & ( eelogOPS_LEN - 1U ) ];
+		ucOpsTail = ucTail + 1U;
+
+		EECR |= _BV( EERE );
+		ucOld = EEDR;
+		if( ucOld == ucNew )
+		{
+			/* No wear, no wait. */
+			continue;
+		}
+
+		if( !( ucNew & ( uint8_t ) ~ucOld ) )
+		{
+			/* Only clears bits, 1.8ms. */
+			EECR = _BV( EEPM1 ) | _BV( EERIE );
+		}
+		else if( ucNew == 0xff )
+		{
+			/* Only sets bits, 1.8ms. */
+			EECR = _BV( EEPM0 ) | _BV( EERIE );
+		}
+		else
+		{
+			/* Erase and write, 3.4ms. */
+			EECR = _BV( EERIE );
+		}
+		EEDR = ucNew;
+		EECR |= _BV( EEMPE );
+		EECR |= _BV( EEPE );
+		return;
+	}
+
+	/* Queue empty, the interrupt stays off until the next append. */
+	EECR &= ~_BV( EERIE );
+}
@@ -0,0 +1,179 @@
+/*
+ * MIT License
+ * Copyright (c) 2024 Vinicius Silva.  All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ */
+
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include "FreeRTOS.h"
+#include "task.h"
+#include "drivers/hcsr04.h"
+
+#ifndef portUSE_TIMER0
+#ifndef portUSE_TIMER2
+	#error The HC-SR04 driver needs Timer 1, define portUSE_TIMER0 or portUSE_TIMER2 for the tick.
+#endif
+#endif
+
+/*-----------------------------------------------------------
+ * Timer 1 input capture driver for the HC-SR04.
+ *
+ * Timer 1 free runs at clk/8 (0.5us).  The capture unit timestamps the
+ * rising echo edge, is then switched to the falling edge and timestamps that
+ * one.  Compare match B is armed one full timer period ahead at the trigger
+ * and again at the rising edge, so a missing or endless echo also ends the
+ * measurement without the task having to poll.
+ *-----------------------------------------------------------*/
+
+#define hcsr04TRIG_BIT					( ( unsigned char ) _BV( PB4 ) )
+
+/* The sensor wants at least 10us of trigger pulse. */
+#define hcsr04TRIG_COUNTS				( ( uint16_t ) ( 10 * hcsr04COUNTS_PER_US ) )
+
+/* Noise canceler on, clk/8.  ICES1 selects the rising edge. */
+#define hcsr04TCCR1B					( ( unsigned char ) ( _BV( ICNC1 ) | _BV( CS11 ) ) )
+
+static TaskHandle_t volatile xWaitingTask = NULL;
+static volatile uint16_t usRisingEdge;
+static volatile uint16_t usEchoWidth;
+
+static void prvStop( void );
+/*-----------------------------------------------------------*/
+
+void vHCSR04Initialise( void )
+{
+	portENTER_CRITICAL();
+	{
+		/* Normal mode, no output compare pins. */
+		TCCR1A = 0;
+		TCCR1B = hcsr04TCCR1B;
+		TIMSK1 = 0;
+
+		/* TRIG as output, low.  ECHO (ICP1) as input. */
+		PORTB &= ~hcsr04TRIG_BIT;
+		DDRB |= hcsr04TRIG_BIT;
+		DDRB &= ~_BV( PB0 );
+	}
+	portEXIT_CRITICAL();
+}
+/*-----------------------------------------------------------*/
+
+uint16_t usHCSR04Measure( TickType_t xBlockTime )
+{
+uint16_t usStart;
+
+	/* Clear anything left from a previous measurement. */
+	( void ) ulTaskNotifyTakeIndexed( hcsr04NOTIFY_INDEX, pdTRUE, 0 );
+
+	portENTER_CRITICAL();
+	{
+		usEchoWidth = hcsr04TIMEOUT;
+		xWaitingTask = xTaskGetCurrentTaskHandle();
+
+		/* Capture the rising edge, time out one timer period from now. */
+		TCCR1B = hcsr04TCCR1B | _BV( ICES1 );
+		usStart = TCNT1;
+		OCR1B = usStart - 1;
+		TIFR1 = _BV( ICF1 ) | _BV( OCF1B );
+		TIMSK1 = _BV( ICIE1 ) | _BV( OCIE1B );
+
+		PORTB |= hcsr04TRIG_BIT;
+	}
+	portEXIT_CRITICAL();
+
+	/* The echo only starts a few hundred us after the trigger falls, the
+	capture interrupt is not needed to end the pulse. */
+	while( ( uint16_t ) ( TCNT1 - usStart ) < hcsr04TRIG_COUNTS )
+	{
+	}
+	PORTB &= ~hcsr04TRIG_BIT;
+
+	/* Sleep until one of the interrupts ends the measurement. */
+	if( ulTaskNotifyTakeIndexed( hcsr04NOTIFY_INDEX, pdTRUE, xBlockTime ) == 0 )
+	{
+		portENTER_CRITICAL();
+		{
+			prvStop();
+		}
+		portEXIT_CRITICAL();
+	}
+
+	return usEchoWidth;
+}
+/*-----------------------------------------------------------*/
+
+static void prvStop( void )
+{
+	/* Called with interrupts disabled. */
+	TIMSK1 = 0;
+	xWaitingTask = NULL;
+}
+/*-----------------------------------------------------------*/
+
+SIGNAL( TIMER1_CAPT_vect )
+{
+uint16_t usCapture;
+signed portBASE_TYPE xHigherPriorityTaskWoken = pdFALSE;
+
+	usCapture = ICR1;
+
+	if( TCCR1B & _BV( ICES1 ) )
+	{
+		/* Rising edge.  Capture the falling one next, the flag has to be
+		cleared after the edge select changes.  Longest echo is one period. */
+		usRisingEdge = usCapture;
+		TCCR1B = hcsr04TCCR1B;
+		TIFR1 = _BV( ICF1 ) | _BV( OCF1B );
+		OCR1B = usCapture - 1;
+	}
+	else
+	{
+		usEchoWidth = usCapture - usRisingEdge;
+		if( xWaitingTask != NULL )
+		{
+			vTaskNotifyGiveIndexedFromISR( xWaitingTask, hcsr04NOTIFY_INDEX, &xHigherPriorityTaskWoken );
+		}
+		prvStop();
+	}
+
+	if( xHigherPriorityTaskWoken != pdFALSE )
+	{
+		taskYIELD();
+	}
+}
+/*-----------------------------------------------------------*/
+
+SIGNAL( TIMER1_COMPB_vect )
+{
+signed portBASE_TYPE xHigherPriorityTaskWoken = pdFALSE;
+
+	/* No edge within a full timer period, usEchoWidth stays hcsr04TIMEOUT. */
+	if( xWaitingTask != NULL )
+	{
+		vTaskNotifyGiveIndexedFromISR( xWaitingTask, hcsr04NOTIFY_INDEX, &xHigherPriorityTaskWoken );
+	}
+	prvStop();
+
+	if( xHigherPriorityTaskWoken != pdFALSE )
+	{
+		taskYIELD();
+	}
+}
@@ -21,11 +21,18 @@
  *
  */
 
-/* BASIC INTERRUPT DRIVEN SERIAL PORT DRIVER. */
+/* BASIC INTERRUPT DRIVEN SERIAL PORT DRIVER.
+ *
+ * Received and transmitted characters go through two single producer / single
+ * consumer ring buffers.  The ISRs only move the head (Rx) or the tail (Tx)
+ * index, the task side only moves the other one, so no critical section is
+ * needed to move data.  A task that has to block registers itself together
+ * with the number of bytes (Rx) or free slots (Tx) it is waiting for, and the
+ * ISR notifies it once that threshold is reached instead of on every byte. */
 #include <stdlib.h>
 #include <avr/interrupt.h>
+#include <avr/pgmspace.h>
 #include "FreeRTOS.h"
-#include "queue.h"
 #include "task.h"
 #include "drivers/serial.h"
 
@@ -37,12 +44,48 @@
 #define serTX_ENABLE					( ( unsigned char ) 0x08 )
 #define serTX_INT_ENABLE				( ( unsigned char ) 0x20 )
 
+/* Constants for reading UCSRA. */
+#define serDATA_OVERRUN					( ( unsigned char ) 0x08 )
+
 /* Constants for writing to UCSRC. */
 #define serUCSRC_SELECT					( ( unsigned char ) 0x80 )
 #define serEIGHT_DATA_BITS				( ( unsigned char ) 0x06 )
 
-static QueueHandle_t xRxedChars;
-static QueueHandle_t xCharsForTx;
+/* Buffer sizes.  Both must be a power of two no larger than 128 so the free
+running 8 bit indexes can tell a full buffer from an empty one. */
+#ifndef serRX_BUFFER_SIZE
+	#define serRX_BUFFER_SIZE			( 64 )
+#endif
+#ifndef serTX_BUFFER_SIZE
+	#define serTX_BUFFER_SIZE			( 32 )
+#endif
+
+#if ( ( serRX_BUFFER_SIZE & ( serRX_BUFFER_SIZE - 1 ) ) != 0 ) || ( serRX_BUFFER_SIZE > 128 )
+	#error serRX_BUFFER_SIZE must be a power of two no larger than 128
+#endif
+#if ( ( serTX_BUFFER_SIZE & ( serTX_BUFFER_SIZE - 1 ) ) != 0 ) || ( serTX_BUFFER_SIZE > 128 )
+	#error serTX_BUFFER_SIZE must be a power of two no larger than 128
+#endif
+
+typedef struct xSERIAL_BUFFER
+{
+	volatile unsigned char ucHead;			/* Next slot to write. */
+	volatile unsigned char ucTail;			/* Next slot to read. */
+	volatile unsigned char ucThreshold;		/* Level xWaitingTask is blocked on. */
+	TaskHandle_t volatile xWaitingTask;		/* Task blocked on this buffer, if any. */
+} xSerialBuffer;
+
+static unsigned char ucRxedChars[ serRX_BUFFER_SIZE ];
+static unsigned char ucCharsForTx[ serTX_BUFFER_SIZE ];
+static xSerialBuffer xRxBuffer;
+static xSerialBuffer xTxBuffer;
+
+/* Counted by the ISRs, read with vSerialGetStats(). */
+static xSerialStats xStats;
+
+/* Bytes waiting in the Rx buffer and free slots left in the Tx buffer. */
+#define serRX_COUNT()		( ( unsigned char ) ( xRxBuffer.ucHead - xRxBuffer.ucTail ) )
+#define serTX_FREE()		( ( unsigned char ) ( serTX_BUFFER_SIZE - ( unsigned char ) ( xTxBuffer.ucHead - xTxBuffer.ucTail ) ) )
 
 #define vInterruptOn()										\
 {															\
@@ -64,15 +107,35 @@ static QueueHandle_t xCharsForTx;
 }
 /*-----------------------------------------------------------*/
 
+/*
+ * Block the calling task until at least ucWanted bytes are in the Rx buffer
+ * (prvRxWait) or ucWanted slots are free in the Tx buffer (prvTxWait), or until
+ * the timeout started in pxTimeOut expires.  The caller must re-check the
+ * buffer level afterwards.
+ */
+static void prvRxWait( unsigned char ucWanted, TimeOut_t *pxTimeOut, TickType_t *pxBlockTime );
+static void prvTxWait( unsigned char ucWanted, TimeOut_t *pxTimeOut, TickType_t *pxBlockTime );
+
+/*
+ * Copy xLength bytes from RAM or, when xInFlash is set, from program memory
+ * into the Tx buffer.
+ */
+static size_t prvWrite( const unsigned char *pucBuffer, size_t xLength, TickType_t xBlockTime, BaseType_t xInFlash );
+/*-----------------------------------------------------------*/
+
 xComPortHandle xSerialPortInitMinimal(unsigned long ulWantedBaud, unsigned portBASE_TYPE uxQueueLength) {
 	unsigned long ulBaudRateCounter;
 	unsigned char ucByte;
 
+	/* The buffers are statically sized by serRX_BUFFER_SIZE and
+	serTX_BUFFER_SIZE. */
+	(void) uxQueueLength;
+
 	portENTER_CRITICAL();
 	{
-		/* Create the queues used by the com test task. */
-		xRxedChars = xQueueCreate( uxQueueLength, ( unsigned portBASE_TYPE ) sizeof( signed char ) );
-		xCharsForTx = xQueueCreate( uxQueueLength, ( unsigned portBASE_TYPE ) sizeof( signed char ) );
+		xRxBuffer.ucHead = xRxBuffer.ucTail = 0;
+		xTxBuffer.ucHead = xTxBuffer.ucTail = 0;
+		xRxBuffer.xWaitingTask = xTxBuffer.xWaitingTask = NULL;
 
 		/* Calculate the baud rate register value from the equation in the
 		data sheet. */
@@ -113,13 +176,73 @@ xComPortHandle xSerialPortInitMinimal(unsigned long ulWantedBaud, unsigned portB
 }
 /*-----------------------------------------------------------*/
 
-signed portBASE_TYPE xSerialGetChar(xComPortHandle pxPort, signed char *pcRxedChar, TickType_t xBlockTime) {
+size_t xSerialRead(xComPortHandle pxPort, void *pvBuffer, size_t xLength, TickType_t xBlockTime) {
+	TimeOut_t xTimeOut;
+	unsigned char *pucBuffer = ( unsigned char * ) pvBuffer;
+	size_t xRead = 0;
+	unsigned char ucCount, ucTail;
+
 	/* Only one port is supported. */
 	(void) pxPort;
 
+	vTaskSetTimeOutState(&xTimeOut);
+
+	while (xRead < xLength) {
+		ucCount = serRX_COUNT();
+
+		if ((ucCount < (xLength - xRead)) && (ucCount < serRX_BUFFER_SIZE / 2)) {
+			/* Wait for the rest, half a buffer at a time so the ISR always
+			has room while this task wakes up. */
+			if ((xLength - xRead) < serRX_BUFFER_SIZE / 2) {
+				prvRxWait(( unsigned char ) (xLength - xRead), &xTimeOut, &xBlockTime);
+			}
+			else {
+				prvRxWait(serRX_BUFFER_SIZE / 2, &xTimeOut, &xBlockTime);
+			}
+
+			ucCount = serRX_COUNT();
+			if (ucCount == 0) {
+				break;
+			}
+		}
+
+		/* Copy the whole span, then release it to the ISR with a single
+		store of the tail index. */
+		ucTail = xRxBuffer.ucTail;
+		for (; (ucCount > 0) && (xRead < xLength); ucCount--) {
+			pucBuffer[ xRead++ ] = ucRxedChars[ ucTail & ( serRX_BUFFER_SIZE - 1 ) ];
+			ucTail++;
+		}
+		xRxBuffer.ucTail = ucTail;
+	}
+
+	return xRead;
+}
+/*-----------------------------------------------------------*/
+
+size_t xSerialWrite(xComPortHandle pxPort, const void *pvBuffer, size_t xLength, TickType_t xBlockTime) {
+	(void) pxPort;
+
+	return prvWrite(( const unsigned char * ) pvBuffer, xLength, xBlockTime, pdFALSE);
+}
+/*-----------------------------------------------------------*/
+
+size_t xSerialWrite_P(xComPortHandle pxPort, const char *pcBuffer, size_t xLength, TickType_t xBlockTime) {
+	(void) pxPort;
+
+	return prvWrite(( const unsigned char * ) pcBuffer, xLength, xBlockTime, pdTRUE);
+}
+/*-----------------------------------------------------------*/
+
+void vSerialPutString(xComPortHandle pxPort, const signed char * const pcString, unsigned short usStringLength) {
+	(void) xSerialWrite(pxPort, pcString, usStringLength, portMAX_DELAY);
+}
+/*-----------------------------------------------------------*/
+
+signed portBASE_TYPE xSerialGetChar(xComPortHandle pxPort, signed char *pcRxedChar, TickType_t xBlockTime) {
 	/* Get the next character from the buffer.  Return false if no characters
 	are available, or arrive after xBlockTime expires. */
-	if (xQueueReceive(xRxedChars, pcRxedChar, xBlockTime)) {
+	if (xSerialRead(pxPort, pcRxedChar, 1, xBlockTime) == 1) {
 		return pdTRUE;
 	}
 	else {
@@ -129,15 +252,11 @@ signed portBASE_TYPE xSerialGetChar(xComPortHandle pxPort, signed char *pcRxedCh
 /*-----------------------------------------------------------*/
 
 signed portBASE_TYPE xSerialPutChar(xComPortHandle pxPort, signed char cOutChar, TickType_t xBlockTime) {
-	(void) pxPort;
-
-	/* Return false if after the block time there is no room on the Tx queue. */
-	if (xQueueSend(xCharsForTx, &cOutChar, xBlockTime ) != pdPASS) {
+	/* Return false if after the block time there is no room on the Tx buffer. */
+	if (xSerialWrite(pxPort, &cOutChar, 1, xBlockTime) != 1) {
 		return pdFAIL;
 	}
 
-	vInterruptOn();
-
 	return pdPASS;
 }
 /*-----------------------------------------------------------*/
@@ -148,8 +267,8 @@ void vSerialClose(xComPortHandle xPort) {
 	/* The parameter is not used. */
 	(void) xPort;
 
-	/* Turn off the interrupts.  We may also want to delete the queues and/or
-	re-install the original ISR. */
+	/* Turn off the interrupts.  We may also want to re-install the original
+	ISR. */
 
 	portENTER_CRITICAL();
 	{
@@ -162,16 +281,168 @@ void vSerialClose(xComPortHandle xPort) {
 }
 /*-----------------------------------------------------------*/
 
+static void prvRxWait( unsigned char ucWanted, TimeOut_t *pxTimeOut, TickType_t *pxBlockTime )
+{
+BaseType_t xMustWait;
+
+	for( ;; )
+	{
+		/* Register as the waiting task only while the level is still short,
+		the ISR clears the registration when it sends the notification. */
+		portENTER_CRITICAL();
+		{
+			xMustWait = ( serRX_COUNT() < ucWanted );
+			xRxBuffer.ucThreshold = ucWanted;
+			xRxBuffer.xWaitingTask = xMustWait ? xTaskGetCurrentTaskHandle() : NULL;
+		}
+		portEXIT_CRITICAL();
+
+		if( ( xMustWait == pdFALSE ) || ( xTaskCheckForTimeOut( pxTimeOut, pxBlockTime ) != pdFALSE ) )
+		{
+			break;
+		}
+
+		/* A notification left over from an earlier wait only causes one more
+		trip around the loop. */
+		ulTaskNotifyTakeIndexed( serNOTIFY_INDEX, pdTRUE, *pxBlockTime );
+	}
+
+	portENTER_CRITICAL();
+	{
+		xRxBuffer.xWaitingTask = NULL;
+	}
+	portEXIT_CRITICAL();
+}
+/*-----------------------------------------------------------*/
+
+static void prvTxWait( unsigned char ucWanted, TimeOut_t *pxTimeOut, TickType_t *pxBlockTime )
+{
+BaseType_t xMustWait;
+
+	for( ;; )
+	{
+		portENTER_CRITICAL();
+		{
+			xMustWait = ( serTX_FREE() < ucWanted );
+			xTxBuffer.ucThreshold = ucWanted;
+			xTxBuffer.xWaitingTask = xMustWait ? xTaskGetCurrentTaskHandle() : NULL;
+		}
+		portEXIT_CRITICAL();
+
+		if( ( xMustWait == pdFALSE ) || ( xTaskCheckForTimeOut( pxTimeOut, pxBlockTime ) != pdFALSE ) )
+		{
+			break;
+		}
+
+		ulTaskNotifyTakeIndexed( serNOTIFY_INDEX, pdTRUE, *pxBlockTime );
+	}
+
+	portENTER_CRITICAL();
+	{
+		xTxBuffer.xWaitingTask = NULL;
+	}
+	portEXIT_CRITICAL();
+}
+/*-----------------------------------------------------------*/
+
+static size_t prvWrite( const unsigned char *pucBuffer, size_t xLength, TickType_t xBlockTime, BaseType_t xInFlash )
+{
+TimeOut_t xTimeOut;
+size_t xWritten = 0;
+unsigned char ucFree, ucHead;
+
+	vTaskSetTimeOutState( &xTimeOut );
+
+	while( xWritten < xLength )
+	{
+		ucFree = serTX_FREE();
+
+		if( ucFree == 0 )
+		{
+			/* Refill half a buffer at a time so the UART keeps shifting out
+			the other half while this task wakes up. */
+			if( ( xLength - xWritten ) < serTX_BUFFER_SIZE / 2 )
+			{
+				prvTxWait( ( unsigned char ) ( xLength - xWritten ), &xTimeOut, &xBlockTime );
+			}
+			else
+			{
+				prvTxWait( serTX_BUFFER_SIZE / 2, &xTimeOut, &xBlockTime );
+			}
+
+			ucFree = serTX_FREE();
+			if( ucFree == 0 )
+			{
+				break;
+			}
+		}
+
+		/* Copy the whole span, then hand it to the ISR with a single store of
+		the head index. */
+		ucHead = xTxBuffer.ucHead;
+		for( ; ( ucFree > 0 ) && ( xWritten < xLength ); ucFree-- )
+		{
+			if( xInFlash != pdFALSE )
+			{
+				ucCharsForTx[ ucHead & ( serTX_BUFFER_SIZE - 1 ) ] = pgm_read_byte( &pucBuffer[ xWritten ] );
+			}
+			else
+			{
+				ucCharsForTx[ ucHead & ( serTX_BUFFER_SIZE - 1 ) ] = pucBuffer[ xWritten ];
+			}
+			ucHead++;
+			xWritten++;
+		}
+		xTxBuffer.ucHead = ucHead;
+
+		vInterruptOn();
+	}
+
+	return xWritten;
+}
+/*-----------------------------------------------------------*/
+
+void vSerialGetStats(xComPortHandle pxPort, xSerialStats *pxStats) {
+	/* Only one port is supported. */
+	(void) pxPort;
+
+	portENTER_CRITICAL();
+	*pxStats = xStats;
+	portEXIT_CRITICAL();
+}
+/*-----------------------------------------------------------*/
+
 SIGNAL(USART_RX_vect) {
-	signed char cChar;
+	unsigned char ucChar, ucHead;
 	signed portBASE_TYPE xHigherPriorityTaskWoken = pdFALSE;
 
-	/* Get the character and post it on the queue of Rxed characters.
-	If the post causes a task to wake force a context switch as the woken task
-	may have a higher priority than the task we have interrupted. */
-	cChar = UDR0;
+	/* A character the USART had no room for was lost before this one.  The
+	flag is only valid until UDR0 is read. */
+	if (UCSR0A & serDATA_OVERRUN) {
+		xStats.usRxDropped++;
+	}
+
+	/* Get the character and store it in the Rx buffer.  UDR0 must be read
+	even when the buffer is full, the character is then lost. */
+	ucChar = UDR0;
+	ucHead = xRxBuffer.ucHead;
+	xStats.ulRxBytes++;
 
-	xQueueSendFromISR(xRxedChars, &cChar, &xHigherPriorityTaskWoken);
+	if (( unsigned char ) ( ucHead - xRxBuffer.ucTail ) >= serRX_BUFFER_SIZE) {
+		xStats.usRxDropped++;
+	}
+	else {
+		ucRxedChars[ ucHead & ( serRX_BUFFER_SIZE - 1 ) ] = ucChar;
+		xRxBuffer.ucHead = ++ucHead;
+
+		/* Only wake the reader once it has what it asked for.  If the wake
+		unblocks a higher priority task force a context switch. */
+		if (( xRxBuffer.xWaitingTask != NULL ) &&
+			( ( unsigned char ) ( ucHead - xRxBuffer.ucTail ) >= xRxBuffer.ucThreshold )) {
+			vTaskNotifyGiveIndexedFromISR(xRxBuffer.xWaitingTask, serNOTIFY_INDEX, &xHigherPriorityTaskWoken);
+			xRxBuffer.xWaitingTask = NULL;
+		}
+	}
 
 	if (xHigherPriorityTaskWoken != pdFALSE) {
 		taskYIELD();
@@ -180,14 +451,28 @@ SIGNAL(USART_RX_vect) {
 /*-----------------------------------------------------------*/
 
 SIGNAL(USART_UDRE_vect) {
-	signed char cChar, cTaskWoken;
+	unsigned char ucTail;
+	signed portBASE_TYPE xHigherPriorityTaskWoken = pdFALSE;
 
-	if (xQueueReceiveFromISR(xCharsForTx, &cChar, &cTaskWoken) == pdTRUE) {
+	ucTail = xTxBuffer.ucTail;
+
+	if (ucTail != xTxBuffer.ucHead) {
 		/* Send the next character queued for Tx. */
-		UDR0 = cChar;
+		UDR0 = ucCharsForTx[ ucTail & ( serTX_BUFFER_SIZE - 1 ) ];
+		xTxBuffer.ucTail = ++ucTail;
+		xStats.ulTxBytes++;
+
+		if (( xTxBuffer.xWaitingTask != NULL ) && ( serTX_FREE() >= xTxBuffer.ucThreshold )) {
+			vTaskNotifyGiveIndexedFromISR(xTxBuffer.xWaitingTask, serNOTIFY_INDEX, &xHigherPriorityTaskWoken);
+			xTxBuffer.xWaitingTask = NULL;
+		}
 	}
 	else {
-		/* Queue empty, nothing to send. */
+		/* Buffer empty, nothing to send. */
 		vInterruptOff();
 	}
+
+	if (xHigherPriorityTaskWoken != pdFALSE) {
+		taskYIELD();
+	}
 }
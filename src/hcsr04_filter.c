@@ -0,0 +1,102 @@
+/*
+ * MIT License
+ * Copyright (c) 2024 Vinicius Silva.  All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ */
+
+#include <string.h>
+#include "hcsr04_filter.h"
+
+#if HCSR04_FILTER_MEDIAN_LEN < 1 || HCSR04_FILTER_MEDIAN_LEN > 15
+#error HCSR04_FILTER_MEDIAN_LEN must be between 1 and 15
+#endif
+
+static hcsr04_data_t median(const hcsr04_filter_t *filter);
+
+void hcsr04FilterInit(hcsr04_filter_t *filter) {
+    memset(filter, 0, sizeof(*filter));
+}
+/*-----------------------------------------------------------*/
+
+BaseType_t hcsr04FilterUpdate(hcsr04_filter_t *filter, hcsr04_data_t raw, hcsr04_data_t *out) {
+
+    hcsr04_data_t value;
+
+    if (raw < HCSR04_FILTER_MIN_US || raw > HCSR04_FILTER_MAX_US) {
+        return pdFALSE;
+    }
+
+#if HCSR04_FILTER_MAX_JUMP_US
+    if (filter->fill) {
+        value = median(filter);
+        if ((raw > value ? raw - value : value - raw) > HCSR04_FILTER_MAX_JUMP_US) {
+            if (++filter->rejected < HCSR04_FILTER_REJECT_LIMIT) {
+                return pdFALSE;
+            }
+            //The target really moved, forget the old level
+            filter->fill = 0;
+            filter->next = 0;
+        }
+    }
+    filter->rejected = 0;
+#endif
+
+    filter->window[filter->next] = raw;
+    if (++filter->next == HCSR04_FILTER_MEDIAN_LEN) {
+        filter->next = 0;
+    }
+    if (filter->fill < HCSR04_FILTER_MEDIAN_LEN) {
+        filter->fill++;
+    }
+    value = median(filter);
+
+#if HCSR04_FILTER_EMA_SHIFT
+    if (filter->fill == 1) {
+        filter->ema = (uint32_t) value << HCSR04_FILTER_EMA_SHIFT;
+    }
+    else {
+        //Decay first: ema settles at value << HCSR04_FILTER_EMA_SHIFT
+        filter->ema -= filter->ema >> HCSR04_FILTER_EMA_SHIFT;
+        filter->ema += value;
+    }
+    value = (hcsr04_data_t) (filter->ema >> HCSR04_FILTER_EMA_SHIFT);
+#endif
+
+    *out = value;
+    return pdTRUE;
+}
+/*-----------------------------------------------------------*/
+
+hcsr04_data_t median(const hcsr04_filter_t *filter) {
+
+    hcsr04_data_t sorted[HCSR04_FILTER_MEDIAN_LEN];
+    hcsr04_data_t v;
+    unsigned char i, j;
+
+    //Insertion sort, the window is a handful of entries
+    for (i = 0; i < filter->fill; i++) {
+        v = filter->window[i];
+        for (j = i; j && sorted[j - 1] > v; j--) {
+            sorted[j] = sorted[j - 1];
+        }
+        sorted[j] = v;
+    }
+    return sorted[(filter->fill - 1) / 2];
+}
@@ -21,55 +21,166 @@
  *
  */
 
-#include <avr/io.h>
 #include "FreeRTOS.h"
 #include "task.h"
 #include "app_data_types.h"
 #include "hcsr04_task.h"
+#include "hcsr04_filter.h"
+#include "drivers/hcsr04.h"
+#include "drivers/eeprom_log.h"
 #include "drivers/digital_io.h"
 
 #define mLED                            mLED_HCSR04
-#define TRIG_PIN                        6      //PORTB bit 4;
-#define ECHO_PIN                        0x01   //PORTB bit 0;
+//Backup only, the driver ends a measurement by itself within ~66 ms
+#define ECHO_TIMEOUT                    pdMS_TO_TICKS(100)
 
-static void delayMicrosecond(char x);
+#if HCSR04_SAMPLE_RATE_HZ
+#define SAMPLE_PERIOD                   ((TickType_t) (configTICK_RATE_HZ / HCSR04_SAMPLE_RATE_HZ))
+_Static_assert(SAMPLE_PERIOD >= 1, "HCSR04_SAMPLE_RATE_HZ must not exceed configTICK_RATE_HZ");
+#endif
+
+#if (HCSR04_RING_LEN & (HCSR04_RING_LEN - 1)) || HCSR04_RING_LEN > 128
+#error HCSR04_RING_LEN must be a power of two up to 128
+#endif
+
+static hcsr04_filter_t filter;
+#if HCSR04_SAMPLE_RATE_HZ
+static uint32_t last_log;       //timestamp of the last sample sent to the EEPROM log
+static unsigned char logged;    //last_log is valid
+#endif
+
+static BaseType_t sample(app_data_handle_t *app_data);
+static hcsr04_data_t measure(void);
+static void store_sample(app_data_handle_t *app_data, hcsr04_data_t value);
+#if HCSR04_SAMPLE_RATE_HZ
+static void log_sample(app_data_handle_t *app_data);
+#endif
 
 void hcsr04Task(void *pvParameters) {
 
-    hcsr04_data_t interval;
-    unsigned int timeout;
+    app_data_handle_t *app_data = (app_data_handle_t*) pvParameters;
+
+    vHCSR04Initialise();
+    hcsr04FilterInit(&filter);
+
+#if HCSR04_SAMPLE_RATE_HZ
+    TickType_t last_wake = xTaskGetTickCount();
 
+    for (;;) {
+        //A slow (no echo) measurement delays the next one, it never piles up
+        vTaskDelayUntil(&last_wake, SAMPLE_PERIOD);
+        //Let mqtt_task collect the ring while half of it is still unread
+        if (sample(app_data)) {
+            if (!app_data->mqtt_online) {
+                log_sample(app_data);
+            }
+            else if (!(app_data->sample_count & (HCSR04_RING_LEN / 2 - 1))) {
+                xTaskNotify(app_data->mqtt_task, APP_EVENT_SENSOR_READY, eSetBits);
+            }
+        }
+    }
+#else
     for (;;) {
 
         vTaskSuspend(NULL); //suspend until task activation;
 
+        //On a rejected reading the last good sample is published again
+        (void) sample(app_data);
+        xTaskNotify(app_data->mqtt_task, APP_EVENT_SENSOR_READY, eSetBits);
+    }
+#endif
+}
+/*-----------------------------------------------------------*/
+
+BaseType_t hcsr04LatestSample(app_data_handle_t *app_data, hcsr04_sample_t *sample) {
+
+    uint16_t count;
+
+    //hcsr04Task runs at a higher priority, do not let it overwrite the slot
+    //half way through the copy.
+    taskENTER_CRITICAL();
+    count = app_data->sample_count;
+    if (count) {
+        *sample = app_data->samples[(unsigned char) (count - 1) & (HCSR04_RING_LEN - 1)];
+    }
+    taskEXIT_CRITICAL();
+    return count ? pdTRUE : pdFALSE;
+}
+/*-----------------------------------------------------------*/
+
+unsigned char hcsr04ReadSamples(app_data_handle_t *app_data, uint16_t *cursor,
+                                hcsr04_sample_t *samples, unsigned char max) {
+
+    unsigned char n = 0;
+    uint16_t count;
+
+    taskENTER_CRITICAL();
+    count = app_data->sample_count;
+    if ((uint16_t) (count - *cursor) > HCSR04_RING_LEN) {
+        *cursor = count - HCSR04_RING_LEN;
+    }
+    for (; n < max && *cursor != count; n++) {
+        samples[n] = app_data->samples[(unsigned char) (*cursor)++ & (HCSR04_RING_LEN - 1)];
+    }
+    taskEXIT_CRITICAL();
+    return n;
+}
+/*-----------------------------------------------------------*/
+
+BaseType_t sample(app_data_handle_t *app_data) {
+
+    hcsr04_data_t value;
+
+    //Timeouts and spikes never reach the ring, nor the broker
+    if (!hcsr04FilterUpdate(&filter, measure(), &value)) {
+        return pdFALSE;
+    }
+    store_sample(app_data, value);
+    return pdTRUE;
+}
+/*-----------------------------------------------------------*/
+
+hcsr04_data_t measure(void) {
+
+    hcsr04_data_t interval;
+
 #ifdef  DEBUG_LED
-        digitalIOToggle(mLED);
+    digitalIOToggle(mLED);
 #endif
-        interval = 0;
-        timeout = 0;
-
-        digitalIOSet(TRIG_PIN, pdTRUE);
-        delayMicrosecond(8);
-        digitalIOSet(TRIG_PIN, pdFALSE);
-        while(!(PINB & ECHO_PIN) && (timeout < 0xffff)) {
-            timeout++;
-        }
-        while((PINB & ECHO_PIN) && (interval < 0xffff)) {
-            interval++;
-        }
-        //Correction factor for while conditional. Consumes 8 CPU clock every interation.
-        //16 CPU clocks eqs 1us
-        interval = interval / 2;
-        ((app_data_handle_t*) pvParameters)->sensor_read = interval;
-        xTaskNotifyGive(((app_data_handle_t*) pvParameters)->mqtt_task);
+    //Echo width in 0.5 us counts, sensor_read keeps reporting us
+    interval = usHCSR04Measure(ECHO_TIMEOUT);
+    if (interval != hcsr04TIMEOUT) {
+        interval /= hcsr04COUNTS_PER_US;
     }
+    return interval;
 }
 /*-----------------------------------------------------------*/
 
-void delayMicrosecond(char x) {
-    static volatile char a;
-    a = x - 1;
-    if (a > 0)
-        delayMicrosecond(a);
+void store_sample(app_data_handle_t *app_data, hcsr04_data_t value) {
+
+    hcsr04_sample_t *sample = &app_data->samples[app_data->sample_count & (HCSR04_RING_LEN - 1)];
+
+    sample->timestamp = ulPortGetTimeMs();
+    sample->value = value;
+    app_data->sensor_read = value;
+    //Readers copy under a critical section, publishing the slot is one store
+    app_data->sample_count++;
 }
+/*-----------------------------------------------------------*/
+
+#if HCSR04_SAMPLE_RATE_HZ
+void log_sample(app_data_handle_t *app_data) {
+
+    hcsr04_sample_t *sample = &app_data->samples[(unsigned char) (app_data->sample_count - 1) & (HCSR04_RING_LEN - 1)];
+
+    //Only queues the bytes, the EEPROM is written from its interrupt. A
+    //record still being written drops this one, the next period retries.
+    if (logged && sample->timestamp - last_log < HCSR04_LOG_PERIOD_MS) {
+        return;
+    }
+    if (xEELogAppend((uint16_t) (sample->timestamp / HCSR04_LOG_TIME_UNIT_MS), sample->value)) {
+        last_log = sample->timestamp;
+        logged = 1;
+    }
+}
+#endif
@@ -20,52 +20,64 @@
  * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
  *
  */
+#include <avr/sleep.h>
+
 #include "FreeRTOS.h"
 #include "task.h"
 #include "app_data_types.h"
 #include "transport_esp8266.h"
 #include "hcsr04_task.h"
 #include "mqtt_task.h"
+#include "stack_sizes.h"
 #include "drivers/digital_io.h"
+#include "drivers/eeprom_log.h"
 
-/* Tasks' priority definitions */
-#define mMQTT_PRIORITY              (tskIDLE_PRIORITY + 0)
-#define m8266RX_PRIORITY            (tskIDLE_PRIORITY + 1)
-#define mHCSR04_PRIORITY            (tskIDLE_PRIORITY + 2)
+/* Tasks' priority definitions. None shares the idle priority, the idle
+ * hook sleeps and would hold such a task off for the rest of its slice. */
+#define mMQTT_PRIORITY              (tskIDLE_PRIORITY + 1)
+#define m8266RX_PRIORITY            (tskIDLE_PRIORITY + 2)
+#define mHCSR04_PRIORITY            (tskIDLE_PRIORITY + 3)
 
-/* Tasks' StackSize definitions: minimal size + padding */
-#define mMQTT_STACK_SIZE            348 + 8
-#define m8266RX_STACK_SIZE          96  + 8
-#define mHCSR04_STACK_SIZE          46  + 8
+/* Tasks' StackSize definitions, generated from measured high-water marks
+ * by tools/stack_sizes.py. The ESP8266 receive task stack is allocated by the
+ * transport. */
+#define mMQTT_STACK_SIZE            STACK_SIZE_MQTT
+#define mHCSR04_STACK_SIZE          STACK_SIZE_HCSR04
 
 static app_data_handle_t app_data;
 
+/* Kernel objects are all static (configSUPPORT_STATIC_ALLOCATION), no heap */
+static StaticTask_t xMQTTTask;
+static StackType_t xMQTTStack[mMQTT_STACK_SIZE];
+static StaticTask_t xHCSR04Task;
+static StackType_t xHCSR04Stack[mHCSR04_STACK_SIZE];
+static StaticTask_t xIdleTask;
+static StackType_t xIdleStack[STACK_SIZE_IDLE];
+
 void vApplicationIdleHook(void); //not used in this app
+void vApplicationStackOverflowHook(TaskHandle_t xTask, char *pcTaskName);
+void vApplicationGetIdleTaskMemory(StaticTask_t **ppxIdleTaskTCBBuffer,
+                                   StackType_t **ppxIdleTaskStackBuffer,
+                                   configSTACK_DEPTH_TYPE *puxIdleTaskStackSize);
 
 short main(void) {
 
     /* Initialize Digital IO ports */
     digitalIOInitialise();
 
+    /* Find the offline log left in the EEPROM */
+    vEELogInitialise();
+
     /* Initialize esp8266AT transport interface */
-    if (esp8266Initialise(m8266RX_STACK_SIZE, NULL, m8266RX_PRIORITY) != pdPASS) {
-        digitalIOSet(mERROR_LED, pdTRUE);
-        for (;;) {}
-    }
+    esp8266Initialise(NULL, m8266RX_PRIORITY);
 
     /* Create HC-SR04 task */
-    if (xTaskCreate(hcsr04Task, "HCSR", mHCSR04_STACK_SIZE, &app_data,
-                    mHCSR04_PRIORITY, &(app_data.sensor_task)) != pdPASS) {
-        digitalIOSet(mERROR_LED, pdTRUE);
-        for (;;) {}
-    }
+    app_data.sensor_task = xTaskCreateStatic(hcsr04Task, "HCSR", mHCSR04_STACK_SIZE, &app_data,
+                                             mHCSR04_PRIORITY, xHCSR04Stack, &xHCSR04Task);
 
     /*  Create MQTT task */
-    if (xTaskCreate(MQTTtask, "MQTT", mMQTT_STACK_SIZE, &app_data,
-                    mMQTT_PRIORITY, &(app_data.mqtt_task)) != pdPASS) {
-        digitalIOSet(mERROR_LED, pdTRUE);
-        for (;;) {}
-    }
+    app_data.mqtt_task = xTaskCreateStatic(MQTTtask, "MQTT", mMQTT_STACK_SIZE, &app_data,
+                                           mMQTT_PRIORITY, xMQTTStack, &xMQTTTask);
 
     /* Start Tasks*/
     vTaskStartScheduler();
@@ -77,5 +89,31 @@ short main(void) {
 
 void vApplicationIdleHook(void) {
     //digitalIOToggle(mARDUINO_BUILTIN_LED);
+    /* IDLE sleep until the next interrupt, the tick at the latest. The USART
+     * and the tick timer keep running in IDLE, deeper modes stop their clock.
+     * Every task is above idle, so an interrupt that readies one switches to
+     * it before this returns. */
+    set_sleep_mode(SLEEP_MODE_IDLE);
+    sleep_mode();
     /*This function must return;*/
 }
+/*-----------------------------------------------------------*/
+
+void vApplicationStackOverflowHook(TaskHandle_t xTask, char *pcTaskName) {
+    (void) xTask;
+    (void) pcTaskName;
+    /* Called from the context switch, RAM past the stack is already
+     * overwritten. Stop with the error LED on instead of running on. */
+    portDISABLE_INTERRUPTS();
+    digitalIOSet(mERROR_LED, pdTRUE);
+    for (;;);
+}
+/*-----------------------------------------------------------*/
+
+void vApplicationGetIdleTaskMemory(StaticTask_t **ppxIdleTaskTCBBuffer,
+                                   StackType_t **ppxIdleTaskStackBuffer,
+                                   configSTACK_DEPTH_TYPE *puxIdleTaskStackSize) {
+    *ppxIdleTaskTCBBuffer = &xIdleTask;
+    *ppxIdleTaskStackBuffer = xIdleStack;
+    *puxIdleTaskStackSize = STACK_SIZE_IDLE;
+}
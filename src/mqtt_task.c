@@ -47,6 +47,7 @@
 /* Standard includes. */
 #include <string.h>
 #include <stdio.h>
+#include <avr/pgmspace.h>
 
 /* Kernel includes. */
 #include "FreeRTOS.h"
@@ -54,12 +55,18 @@
 
 /* MQTT library includes. */
 #include "core_mqtt.h"
+#include "core_mqtt_state.h"
 
 /* Transport interface implementation include header for esp8266AT connection. */
 #include "transport_esp8266.h"
 
 #include "app_data_types.h"
+#include "mqtt_budget.h"
 #include "mqtt_task.h"
+#include "hcsr04_task.h"
+#include "app_protocol.h"
+#include "runtime_stats.h"
+#include "drivers/eeprom_log.h"
 #include "drivers/digital_io.h"
 
 #define mLED                                     mLED_MQTT
@@ -109,7 +116,7 @@ if (!(x)) { \
 /**
  * @brief Size of the network buffer for MQTT packets.
  */
-#define democonfigNETWORK_BUFFER_SIZE    ( 32U )
+#define democonfigNETWORK_BUFFER_SIZE    mqttbudgetNETWORK_BUFFER_SIZE
 
 /*-----------------------------------------------------------*/
 
@@ -130,6 +137,12 @@ if (!(x)) { \
  */
 #define mqttexampleRETRY_BACKOFF_BASE_MS                  ( 500U )
 
+/**
+ * @brief Largest payload of a QoS1/QoS2 publish kept for sending it again after
+ * a reconnect. The state topic carries one frame, see app_protocol.h.
+ */
+#define mqttexampleRESEND_PAYLOAD_SIZE                    ( APP_FRAME_SIZE )
+
 /**
  * @brief Timeout for receiving CONNACK packet in milliseconds.
  */
@@ -143,16 +156,74 @@ if (!(x)) { \
  */
 #define mqttexampleRX_TOPIC_NAME                           "/home/garage/control"
 #define mqttexampleTX_TOPIC_NAME                           "/home/garage/state"
+#define mqttexampleTELEMETRY_TOPIC_NAME                    "/home/garage/telemetry"
+#define mqttexampleBACKLOG_TOPIC_NAME                      "/home/garage/backlog"
+#define mqttexampleDIAG_TOPIC_NAME                         "/home/garage/diag"
 
 /**
- * @brief The number of topic filters to subscribe.
+ * @brief QoS used for each topic, see #xTopicQoS. High rate telemetry goes
+ * at QoS0, state changes, commands and the EEPROM backlog, which only leaves
+ * the log on the PUBACK, get delivery guarantees.
+ */
+#define mqttexampleRX_TOPIC_QOS                            MQTTQoS2
+#define mqttexampleTX_TOPIC_QOS                            MQTTQoS1
+#define mqttexampleTELEMETRY_TOPIC_QOS                     MQTTQoS0
+#define mqttexampleBACKLOG_TOPIC_QOS                       MQTTQoS1
+#define mqttexampleDIAG_TOPIC_QOS                          MQTTQoS0
+
+/**
+ * @brief Topics subscribed to, X( topic, key, dispatcher, frame dispatcher ).
+ * The key is the character of the topic at mqttexampleTOPIC_KEY_INDEX, '\0'
+ * for a shorter topic. The dispatcher gets the ASCII commands found in the
+ * payloads, the frame dispatcher the binary ones (NULL to ignore them).
+ */
+#define mqttexampleSUBSCRIPTIONS( X ) \
+    X( mqttexampleRX_TOPIC_NAME, 'c', prvRxCommand, prvRxFrame )
+
+/**
+ * @brief Commands accepted on mqttexampleRX_TOPIC_NAME, X( command, first
+ * character, handler ).
+ */
+#define mqttexampleRX_COMMANDS( X )     \
+    X( ON,     'O', prvCommandOn )      \
+    X( OFF,    'O', prvCommandOff )     \
+    X( UPDATE, 'U', prvCommandUpdate )
+
+/**
+ * @brief Binary opcodes accepted on mqttexampleRX_TOPIC_NAME, X( opcode,
+ * handler ). The opcode is the slot of the handler.
+ */
+#define mqttexampleRX_OPCODES( X )        \
+    X( APP_OP_OUTPUT, prvOpOutput )       \
+    X( APP_OP_READ,   prvOpRead )
+
+/**
+ * @brief Outputs APP_OP_OUTPUT may drive: mLED_0 to mLED_6, less the debug
+ * LEDs (mLED_8266RX to mLED_MQTT) when DEBUG_LED is on.
  */
-#define mqttexampleTOPIC_COUNT                            ( 1 )
+#ifdef DEBUG_LED
+    #define mqttexampleHOST_OUTPUT( x )    ( ( ( x ) <= mLED_6 ) && ( ( ( x ) < mLED_8266RX ) || ( ( x ) > mLED_MQTT ) ) )
+#else
+    #define mqttexampleHOST_OUTPUT( x )    ( ( x ) <= mLED_6 )
+#endif
+
+/**
+ * @brief Dispatch tables. An entry sits at the slot given by its length and
+ * key character, so a lookup is one table read and one compare. Two entries
+ * on the same slot fail the build, pick another key index or hash then.
+ * Table sizes are powers of two.
+ */
+#define mqttexampleTOPIC_SLOTS                            ( 4U )
+#define mqttexampleCOMMAND_SLOTS                          ( 8U )
+#define mqttexampleOPCODE_SLOTS                           ( 4U )
+#define mqttexampleTOPIC_KEY_INDEX                        ( 13U )
+#define mqttexampleSLOT( xLength, cKey, xSlots )          ( ( ( xLength ) * 5U + ( uint8_t ) ( cKey ) ) & ( ( xSlots ) - 1U ) )
 
 /**
- * @brief The size of the buffer for each topic string.
+ * @brief The number of topic filters to subscribe.
  */
-#define mqttexampleTOPIC_BUFFER_SIZE                      ( 32U )
+#define mqttexampleCOUNT_ENTRY( ... )                     + 1U
+#define mqttexampleTOPIC_COUNT                            ( 0U mqttexampleSUBSCRIPTIONS( mqttexampleCOUNT_ENTRY ) )
 
 /**
  * @brief The MQTT message published in this example.
@@ -194,18 +265,74 @@ if (!(x)) { \
 /**
  * @brief The length of the outgoing publish records array used by the coreMQTT
  * library to track QoS > 0 packet ACKS for outgoing publishes.
- * Number of publishes = ulMaxPublishCount * mqttexampleTOPIC_COUNT
- * Update in ulMaxPublishCount needs updating mqttexampleOUTGOING_PUBLISH_RECORD_LEN.
+ * Set by the number of in-flight messages in mqtt_budget.h.
  */
-#define mqttexampleOUTGOING_PUBLISH_RECORD_LEN            ( 10U )
+#define mqttexampleOUTGOING_PUBLISH_RECORD_LEN            mqttbudgetOUTGOING_PUBLISH_RECORDS
 
 /**
  * @brief The length of the incoming publish records array used by the coreMQTT
  * library to track QoS > 0 packet ACKS for incoming publishes.
- * Number of publishes = ulMaxPublishCount * mqttexampleTOPIC_COUNT
- * Update in ulMaxPublishCount needs updating mqttexampleINCOMING_PUBLISH_RECORD_LEN.
+ * Set by the number of in-flight messages in mqtt_budget.h.
+ */
+#define mqttexampleINCOMING_PUBLISH_RECORD_LEN            mqttbudgetINCOMING_PUBLISH_RECORDS
+
+/**
+ * @brief Size of the chunks the payload of a PUBLISH that does not fit in
+ * ucSharedBuffer is read and handed to the application in. Taken from the
+ * MQTT task stack while the packet is being streamed.
+ */
+#define mqttexampleSTREAM_CHUNK_SIZE                      ( 16U )
+
+/**
+ * @brief Maximum time in milliseconds to wait for the rest of a streamed
+ * PUBLISH once its fixed header has been read.
+ */
+#define mqttexampleSTREAM_TIMEOUT_MS                      ( 2000U )
+
+/**
+ * @brief Longest command accepted in a PUBLISH payload. Commands are separated
+ * by white space, ',' or ';', so one PUBLISH can carry a batch of them.
+ */
+#define mqttexampleCOMMAND_MAX_LEN                        ( 8U )
+
+/**
+ * @brief Batched telemetry, used when hcsr04_task samples periodically.
+ *
+ * Samples are collected from the sensor ring and published together on
+ * mqttexampleTELEMETRY_TOPIC_NAME once mqttexampleBATCH_MAX_SAMPLES are in,
+ * or the oldest one is mqttexampleBATCH_MAX_AGE_MS old. Payload layout, all
+ * multi-byte fields little endian:
+ *
+ *   uint8_t  count          samples in the batch
+ *   uint8_t  unit_ms        milliseconds per timestamp unit, 1 for live
+ *                           batches, HCSR04_LOG_TIME_UNIT_MS for the backlog
+ *   uint16_t base           timestamp of the first sample, low 16 bits
+ *   count times:
+ *     uint8_t  delta        units since the previous sample, 255 saturates
+ *                           in the backlog, a live batch ends before that
+ *     uint16_t value        echo width in us
+ */
+#define mqttexampleBATCH_MAX_SAMPLES                      ( 10U )
+#define mqttexampleBATCH_MAX_AGE_MS                       ( 2000U )
+#define mqttexampleBATCH_HEADER_SIZE                      ( 4U )
+#define mqttexampleBATCH_SAMPLE_SIZE                      ( 3U )
+
+#if HCSR04_SAMPLE_RATE_HZ
+    _Static_assert( 1000U / HCSR04_SAMPLE_RATE_HZ <= 0xFFU,
+                    "the sample period must fit the 1 ms delta byte of live batches" );
+#endif
+
+/**
+ * @brief Period of the run time statistics published on
+ * mqttexampleDIAG_TOPIC_NAME, record layout in runtime_stats.h. The CPU
+ * shares cover the time since the previous record. Profiling builds report
+ * more often for tools/stack_sizes.py.
  */
-#define mqttexampleINCOMING_PUBLISH_RECORD_LEN            ( 10U )
+#ifdef STACK_PROFILE
+    #define mqttexampleDIAG_PERIOD_MS                     ( 5000U )
+#else
+    #define mqttexampleDIAG_PERIOD_MS                     ( 30000U )
+#endif
 
 /**
  * @brief Milliseconds per second.
@@ -226,23 +353,106 @@ if (!(x)) { \
  *
  * @note Transport stacks are defined in FreeRTOS-Plus/Source/Application-Protocols/network_transport.
  */
-/* NOT USED */
-/*
+/* The esp8266 transport has a single connection and ignores the context. It
+ * only carries the MQTT context to #prvStreamingRecv. */
 struct NetworkContext
 {
-    PlaintextTransportParams_t * pParams;
+    MQTTContext_t * pxMQTTContext;
 };
-*/
 /*-----------------------------------------------------------*/
 
 /**
- * @brief Sends an MQTT Connect packet over the already connected TLS over TCP connection.
+ * @brief States of the connection to the broker, driven by #MQTTtask.
+ */
+typedef enum connectionState
+{
+    eStateNoTransport = 0, /* No TCP connection to the broker. */
+    eStateTransportUp,     /* TCP connected, CONNECT not accepted yet. */
+    eStateSessionOpen,     /* CONNACK received, session not restored yet. */
+    eStateOnline           /* Subscribed and caught up, normal operation. */
+} connectionState_t;
+
+/**
+ * @brief Copy of a QoS1/QoS2 publish kept until the broker has it.
+ */
+typedef struct publishCopy
+{
+    uint16_t usPacketId;     /* MQTT_PACKET_ID_INVALID when the slot is free. */
+    const char * pcTopic;
+    uint8_t ucLength;
+    uint8_t ucPayload[ mqttexampleRESEND_PAYLOAD_SIZE ];
+} publishCopy_t;
+
+/**
+ * @brief Initializes the MQTT library. Called once, the publish records must
+ * survive reconnects.
  *
  * @param[in, out] pxMQTTContext MQTT context pointer.
  * @param[in] xNetworkContext network context.
  */
-static void prvCreateMQTTConnectionWithBroker( MQTTContext_t * pxMQTTContext,
-                                               NetworkContext_t * pxNetworkContext );
+static void prvInitializeMQTT( MQTTContext_t * pxMQTTContext,
+                               NetworkContext_t * pxNetworkContext );
+
+/**
+ * @brief Sends an MQTT Connect packet over the already connected TCP connection,
+ * resuming the session kept by the broker, if any.
+ *
+ * @param[in, out] pxMQTTContext MQTT context pointer.
+ * @param[out] pxSessionPresent Session present flag from the CONNACK.
+ *
+ * @return MQTTSuccess once the CONNACK is received.
+ */
+static MQTTStatus_t prvCreateMQTTConnectionWithBroker( MQTTContext_t * pxMQTTContext,
+                                                       bool * pxSessionPresent );
+
+/**
+ * @brief Sends the QoS1/QoS2 publishes not acknowledged by the broker again.
+ *
+ * @param[in] pxMQTTContext MQTT context pointer.
+ * @param[in] xSessionPresent The broker resumed the previous session.
+ *
+ * @return false if a send failed.
+ */
+static bool prvResendPublishes( MQTTContext_t * pxMQTTContext,
+                                bool xSessionPresent );
+
+/**
+ * @brief Closes the MQTT and TCP connection after a failure, or before
+ * trying again. The session state is kept.
+ *
+ * @param[in] pxMQTTContext MQTT context pointer.
+ */
+static void prvDropConnection( MQTTContext_t * pxMQTTContext );
+
+/**
+ * @brief Waits *pusBackOffMs, then doubles it up to
+ * mqttexampleRETRY_MAX_BACKOFF_DELAY_MS.
+ *
+ * @param[in, out] pusBackOffMs Current back-off delay.
+ */
+static void prvBackOff( uint16_t * pusBackOffMs );
+
+/**
+ * @brief Finds the copy of a publish, MQTT_PACKET_ID_INVALID finds a free slot.
+ *
+ * @param[in] usPacketId Packet id of the publish.
+ *
+ * @return The copy, NULL if there is none.
+ */
+static publishCopy_t * prvFindCopy( uint16_t usPacketId );
+
+/**
+ * @brief Publishes a kept copy with its packet id.
+ *
+ * @param[in] pxMQTTContext MQTT context pointer.
+ * @param[in] pxCopy The copy.
+ * @param[in] xDup Set the DUP flag, the broker may have seen it already.
+ *
+ * @return Returns the return value of #MQTT_Publish.
+ */
+static MQTTStatus_t prvSendCopy( MQTTContext_t * pxMQTTContext,
+                                 const publishCopy_t * pxCopy,
+                                 bool xDup );
 
 /**
  * @brief Function to update variable #Context with status
@@ -259,15 +469,102 @@ static void prvUpdateSubAckStatus( MQTTPacketInfo_t * pxPacketInfo );
  * retried using an exponential backoff strategy with jitter.
  *
  * @param[in] pxMQTTContext MQTT context pointer.
+ *
+ * @return false if the connection failed.
  */
-static void prvMQTTSubscribeWithBackoffRetries( MQTTContext_t * pxMQTTContext );
+static bool prvMQTTSubscribeWithBackoffRetries( MQTTContext_t * pxMQTTContext );
 
 /**
  * @brief Publishes a message mqttexampleMESSAGE on mqttexampleTOPIC topic.
  *
  * @param[in] pxMQTTContext MQTT context pointer.
  */
-static void prvMQTTPublishToTopics( MQTTContext_t *pxMQTTContext );
+static void prvMQTTPublishToTopics( MQTTContext_t *pxMQTTContext,
+                                    uint8_t ucSeq );
+
+/**
+ * @brief Publishes a payload on a topic.
+ *
+ * @param[in] pxMQTTContext MQTT context pointer.
+ * @param[in] pcTopic Topic name.
+ * @param[in] pvPayload Payload, it must stay valid until the call returns.
+ * @param[in] xLength Payload length.
+ */
+static void prvPublish( MQTTContext_t * pxMQTTContext,
+                        const char * pcTopic,
+                        const void * pvPayload,
+                        size_t xLength );
+
+/**
+ * @brief Looks a topic up in #xTopicQoS.
+ *
+ * @param[in] pcTopic Topic name.
+ *
+ * @return The QoS configured for the topic, QoS0 if it is not in the table.
+ */
+static MQTTQoS_t prvTopicQoS( const char * pcTopic );
+
+/**
+ * @brief Publishes a run time statistics record on mqttexampleDIAG_TOPIC_NAME
+ * every mqttexampleDIAG_PERIOD_MS.
+ *
+ * @param[in] pxMQTTContext MQTT context pointer.
+ */
+static void prvPublishDiagnostics( MQTTContext_t * pxMQTTContext );
+
+#if HCSR04_SAMPLE_RATE_HZ
+
+/**
+ * @brief Moves new samples from the sensor ring into the telemetry batch and
+ * publishes the batch when it is full or old enough.
+ *
+ * @param[in] pxMQTTContext MQTT context pointer.
+ */
+static void prvCollectSamples( MQTTContext_t * pxMQTTContext );
+
+/**
+ * @brief Publishes #ucBatch on mqttexampleTELEMETRY_TOPIC_NAME and empties it.
+ *
+ * @param[in] pxMQTTContext MQTT context pointer.
+ */
+static void prvPublishBatch( MQTTContext_t * pxMQTTContext );
+
+/**
+ * @brief Appends a sample to #ucBatch. A delta over 255 units saturates, the
+ * caller starts a new batch first where that matters.
+ *
+ * @return true once the batch is full.
+ */
+static bool prvBatchAdd( uint16_t usTimestamp,
+                         uint8_t ucUnitMs,
+                         hcsr04_data_t xValue );
+
+/**
+ * @brief Publishes one batch of the readings logged to the EEPROM while
+ * offline on mqttexampleBACKLOG_TOPIC_NAME, same layout as the telemetry.
+ * Runs between live batches, one batch in flight at a time, until the log
+ * is empty. The records are consumed on the PUBACK.
+ *
+ * @param[in] pxMQTTContext MQTT context pointer.
+ */
+static void prvDrainLog( MQTTContext_t * pxMQTTContext );
+
+/**
+ * @brief Builds the backlog batch from the oldest records of the log in
+ * #ucBatch and publishes it with the packet id given. A live batch still
+ * open is published first.
+ *
+ * @param[in] pxMQTTContext MQTT context pointer.
+ * @param[in] usPacketId Packet id of the PUBLISH.
+ * @param[in] xDup Resend after a reconnect.
+ *
+ * @return The #MQTT_Publish result.
+ */
+static MQTTStatus_t prvSendBacklog( MQTTContext_t * pxMQTTContext,
+                                    uint16_t usPacketId,
+                                    bool xDup );
+
+#endif
 
 /**
  * @brief Unsubscribes from the previously subscribed topic as specified
@@ -329,24 +626,199 @@ static MQTTStatus_t prvProcessLoopWithTimeout( MQTTContext_t * pMqttContext,
                                                uint32_t ulTimeoutMs );
 
 /**
- * @brief Initialize the topic filter string and SUBACK buffers.
+ * @brief Call #MQTT_ProcessLoop while the transport has received data, or a
+ * packet is partially read, for at most mqttexamplePROCESS_LOOP_TIMEOUT_MS.
+ *
+ * @param[in] pxMQTTContext MQTT context pointer.
+ *
+ * @return Returns the return value of the last call to #MQTT_ProcessLoop.
+ */
+static MQTTStatus_t prvProcessPendingPackets( MQTTContext_t * pxMQTTContext );
+
+/**
+ * @brief Transport receive function given to coreMQTT. Passes packets through
+ * one at a time, except a PUBLISH too large for ucSharedBuffer, which is read
+ * here and streamed to the command parser in chunks. coreMQTT never sees it;
+ * its QoS state is updated and the ack sent here.
+ *
+ * @param[in] pxNetworkContext Network context, holds the MQTT context.
+ * @param[out] pvBuffer Buffer to receive into.
+ * @param[in] xBytesToRecv Maximum bytes to receive.
+ *
+ * @return Bytes received, or a negative value when the stream cannot be
+ * followed anymore.
  */
-static void prvInitializeTopicBuffers( void );
+static int32_t prvStreamingRecv( NetworkContext_t * pxNetworkContext,
+                                 void * pvBuffer,
+                                 size_t xBytesToRecv );
 
-/*-----------------------------------------------------------*/
+/**
+ * @brief Reads the fixed header of the next packet into #xStream.
+ *
+ * @return 1 once the header is complete, 0 if more bytes are needed, -1 if it
+ * is malformed.
+ */
+static int32_t prvReadFixedHeader( void );
 
 /**
- * @brief Static buffer used to hold MQTT messages being sent and received.
+ * @brief Reads the rest of the PUBLISH whose fixed header is in #xStream,
+ * feeds its payload to the command parser and acknowledges it.
+ *
+ * @param[in] pxMQTTContext MQTT context pointer.
+ *
+ * @return true on success, false if the connection is out of sync.
  */
-static uint8_t ucSharedBuffer[ democonfigNETWORK_BUFFER_SIZE ];
+static bool prvStreamPublish( MQTTContext_t * pxMQTTContext );
+
+/**
+ * @brief Receives exactly xLength bytes, or fails after
+ * mqttexampleSTREAM_TIMEOUT_MS without the full amount.
+ */
+static bool prvRecvExact( MQTTContext_t * pxMQTTContext,
+                          uint8_t * pucBuffer,
+                          size_t xLength );
+
+/**
+ * @brief Runs a command, see mqttexampleRX_COMMANDS.
+ */
+typedef void ( * commandHandler_t )( MQTTContext_t * pxMQTTContext );
+
+/**
+ * @brief Looks up and runs a command found in the payload of a subscribed
+ * topic, see mqttexampleSUBSCRIPTIONS.
+ */
+typedef void ( * commandDispatch_t )( MQTTContext_t * pxMQTTContext,
+                                      const char * pcCommand,
+                                      uint8_t ucLength );
+
+/**
+ * @brief Decodes and runs a binary frame received on a subscribed topic, see
+ * app_protocol.h.
+ */
+typedef void ( * frameDispatch_t )( MQTTContext_t * pxMQTTContext,
+                                    const uint8_t * pucPayload,
+                                    size_t xLength );
+
+/**
+ * @brief Runs a decoded frame, see mqttexampleRX_OPCODES.
+ */
+typedef void ( * opcodeHandler_t )( MQTTContext_t * pxMQTTContext,
+                                    const app_frame_t * pxFrame );
+
+/**
+ * @brief Slot of #xSubscriptions.
+ */
+typedef struct subscription
+{
+    const char * pcTopic;          /* In RAM, SUBSCRIBE sends it from there. */
+    uint8_t ucLength;              /* 0 for a free slot. */
+    commandDispatch_t pxDispatch;
+    frameDispatch_t pxFrame;
+} subscription_t;
+
+/**
+ * @brief Slot of a command table.
+ */
+typedef struct command
+{
+    const char * pcName;           /* In flash. */
+    uint8_t ucLength;              /* 0 for a free slot. */
+    commandHandler_t pxHandler;
+} command_t;
+
+/**
+ * @brief Splits a payload, or a chunk of one, into commands and passes them
+ * to the dispatcher of the topic.
+ *
+ * @param[in] pxMQTTContext MQTT context pointer.
+ * @param[in] pxDispatch Dispatcher of the topic.
+ * @param[in] pucPayload Payload bytes.
+ * @param[in] xLength Number of bytes.
+ * @param[in] xLast true for the end of the payload.
+ */
+static void prvTokenizeCommands( MQTTContext_t * pxMQTTContext,
+                                 commandDispatch_t pxDispatch,
+                                 const uint8_t * pucPayload,
+                                 size_t xLength,
+                                 bool xLast );
+
+/**
+ * @brief Key character of a topic, see mqttexampleTOPIC_KEY_INDEX.
+ */
+static char prvTopicKey( const char * pcTopic,
+                         uint16_t usLength );
+
+/**
+ * @brief Copies the only subscription a topic of this length and key can be.
+ *
+ * @return false if there is none. The topic still has to be compared.
+ */
+static bool prvFindSubscription( uint16_t usLength,
+                                 char cKey,
+                                 subscription_t * pxSubscription );
+
+/**
+ * @brief Dispatcher of mqttexampleRX_TOPIC_NAME.
+ */
+static void prvRxCommand( MQTTContext_t * pxMQTTContext,
+                          const char * pcCommand,
+                          uint8_t ucLength );
+
+/**
+ * @brief Command handlers, see mqttexampleRX_COMMANDS.
+ */
+static void prvCommandOn( MQTTContext_t * pxMQTTContext );
+static void prvCommandOff( MQTTContext_t * pxMQTTContext );
+static void prvCommandUpdate( MQTTContext_t * pxMQTTContext );
+
+/**
+ * @brief Frame dispatcher of mqttexampleRX_TOPIC_NAME. Frames that do not
+ * decode, or carry an unknown opcode, are answered with an APP_OP_ACK
+ * holding the error.
+ */
+static void prvRxFrame( MQTTContext_t * pxMQTTContext,
+                        const uint8_t * pucPayload,
+                        size_t xLength );
+
+/**
+ * @brief Opcode handlers, see mqttexampleRX_OPCODES.
+ */
+static void prvOpOutput( MQTTContext_t * pxMQTTContext,
+                         const app_frame_t * pxFrame );
+static void prvOpRead( MQTTContext_t * pxMQTTContext,
+                       const app_frame_t * pxFrame );
+
+/**
+ * @brief Publishes a new reading with the sequence number given, now or
+ * once the sensor task has one, depending on the sampling mode.
+ */
+static void prvRequestReading( MQTTContext_t * pxMQTTContext,
+                               uint8_t ucSeq );
+
+/**
+ * @brief Encodes a frame and publishes it on mqttexampleTX_TOPIC_NAME.
+ */
+static void prvPublishFrame( MQTTContext_t * pxMQTTContext,
+                             uint8_t ucOpcode,
+                             uint8_t ucSeq,
+                             uint8_t ucArg,
+                             uint16_t usValue );
+
+/**
+ * @brief Ticks left until #MQTT_ProcessLoop has to run for the keep-alive,
+ * either to send a PINGREQ or to check for the PINGRESP, or until the next
+ * run time statistics record is due, whichever comes first.
+ *
+ * @param[in] pxMQTTContext MQTT context pointer.
+ */
+static TickType_t prvTicksToKeepAlive( MQTTContext_t * pxMQTTContext );
+
+/*-----------------------------------------------------------*/
 
 /**
- * @brief Global entry time into the application to use as a reference timestamp
- * in the #prvGetTimeMs function. #prvGetTimeMs will always return the difference
- * between the current time and the global entry time. This will reduce the chances
- * of overflow for the 32 bit unsigned integer used for holding the timestamp.
+ * @brief Static buffer used to hold MQTT messages being sent and received.
  */
-static uint32_t ulGlobalEntryTimeMs = 0;
+static uint8_t ucSharedBuffer[ democonfigNETWORK_BUFFER_SIZE ];
 
 /**
  * @brief Packet Identifier generated when Publish request was sent to the broker;
@@ -368,19 +840,77 @@ static uint16_t usSubscribePacketIdentifier;
 static uint16_t usUnsubscribePacketIdentifier;
 
 /**
- * @brief A pair containing a topic filter and its SUBACK status.
+ * @brief A topic and the QoS used to publish, or subscribe, to it.
+ */
+typedef struct topicQoS
+{
+    const char * pcTopic;
+    MQTTQoS_t xQoS;
+} topicQoS_t;
+
+/**
+ * @brief Per topic QoS table.
+ */
+static const topicQoS_t xTopicQoS[] =
+{
+    { mqttexampleRX_TOPIC_NAME,        mqttexampleRX_TOPIC_QOS        },
+    { mqttexampleTX_TOPIC_NAME,        mqttexampleTX_TOPIC_QOS        },
+    { mqttexampleTELEMETRY_TOPIC_NAME, mqttexampleTELEMETRY_TOPIC_QOS },
+    { mqttexampleBACKLOG_TOPIC_NAME,   mqttexampleBACKLOG_TOPIC_QOS   },
+    { mqttexampleDIAG_TOPIC_NAME,      mqttexampleDIAG_TOPIC_QOS      }
+};
+
+/**
+ * @brief The SUBACK status of each subscription, in #xSubscriptions order;
+ * updated when the event callback processes a SUBACK.
+ */
+static MQTTSubAckStatus_t xSubAckStatus[ mqttexampleTOPIC_COUNT ];
+
+#define mqttexampleSUBSCRIPTION_ENTRY( pcTopic, cKey, pxDispatch, pxFrame ) \
+    [ mqttexampleSLOT( sizeof( pcTopic ) - 1U, cKey, mqttexampleTOPIC_SLOTS ) ] = { pcTopic, sizeof( pcTopic ) - 1U, pxDispatch, pxFrame },
+#define mqttexampleCOMMAND_NAME( xName, cKey, pxHandler ) \
+    static const char cCommand ## xName[] PROGMEM = # xName;
+#define mqttexampleCOMMAND_ENTRY( xName, cKey, pxHandler ) \
+    [ mqttexampleSLOT( sizeof( # xName ) - 1U, cKey, mqttexampleCOMMAND_SLOTS ) ] = { cCommand ## xName, sizeof( # xName ) - 1U, pxHandler },
+#define mqttexampleOPCODE_ENTRY( xOpcode, pxHandler ) \
+    [ xOpcode ] = pxHandler,
+
+mqttexampleRX_COMMANDS( mqttexampleCOMMAND_NAME )
+
+/* A slot initialized twice is a collision. */
+#pragma GCC diagnostic push
+#pragma GCC diagnostic error "-Woverride-init"
+
+/**
+ * @brief Subscriptions by topic length and key.
+ */
+static const subscription_t xSubscriptions[ mqttexampleTOPIC_SLOTS ] PROGMEM =
+{
+    mqttexampleSUBSCRIPTIONS( mqttexampleSUBSCRIPTION_ENTRY )
+};
+
+/**
+ * @brief Commands of mqttexampleRX_TOPIC_NAME by length and first character.
  */
-typedef struct topicFilterContext
+static const command_t xRxCommands[ mqttexampleCOMMAND_SLOTS ] PROGMEM =
 {
-    uint8_t pcTopicFilter[ mqttexampleTOPIC_BUFFER_SIZE ];
-    MQTTSubAckStatus_t xSubAckStatus;
-} topicFilterContext_t;
+    mqttexampleRX_COMMANDS( mqttexampleCOMMAND_ENTRY )
+};
 
 /**
- * @brief An array containing the context of a SUBACK; the SUBACK status
- * of a filter is updated when the event callback processes a SUBACK.
+ * @brief Binary opcodes of mqttexampleRX_TOPIC_NAME, NULL for unknown ones.
  */
-static topicFilterContext_t xTopicFilterContext[ mqttexampleTOPIC_COUNT ];
+static const opcodeHandler_t xRxOpcodes[ mqttexampleOPCODE_SLOTS ] PROGMEM =
+{
+    mqttexampleRX_OPCODES( mqttexampleOPCODE_ENTRY )
+};
+
+#pragma GCC diagnostic pop
+
+_Static_assert( mqttexampleTOPIC_KEY_INDEX < mqttexampleSTREAM_CHUNK_SIZE,
+                "prvStreamPublish needs the topic key in the first chunk" );
+_Static_assert( APP_FRAME_SIZE <= mqttexampleSTREAM_CHUNK_SIZE,
+                "prvStreamPublish needs a whole frame in the first chunk" );
 
 
 /** @brief Static buffer used to hold MQTT messages being sent and received. */
@@ -412,79 +942,229 @@ static MQTTPubAckInfo_t pIncomingPublishRecords[ mqttexampleINCOMING_PUBLISH_REC
 
 static app_data_handle_t *app_data;
 
-/*
- * @brief The Example shown below uses MQTT APIs to create MQTT messages and
- * send them over the server-authenticated network connection established with the
- * MQTT broker. This example is single-threaded and uses statically allocated
- * memory. It uses QoS2 for sending and receiving messages from the broker.
- *
- * This MQTT client subscribes to the topic as specified in mqttexampleTOPIC at the
- * top of this file by sending a subscribe packet and waiting for a subscribe
- * acknowledgment (SUBACK) from the broker. The client will then publish to the
- * same topic it subscribed to, therefore expecting that all outgoing messages will be
- * sent back from the broker.
+/**
+ * @brief An UPDATE command or APP_OP_READ frame is waiting for the sensor
+ * task to finish a reading, and the sequence number to answer it with.
  */
-void MQTTtask( void * pvParameters )
-{
-    MQTTContext_t xMQTTContext = { 0 };
-    esp8266TransportStatus_t xNetworkStatus;
+static bool xUpdatePending = false;
+static uint8_t ucUpdateSeq;
 
-    app_data = (app_data_handle_t*) pvParameters;
+#if HCSR04_SAMPLE_RATE_HZ
 
-    /* Set the entry time of the demo application. This entry time will be used
-     * to calculate relative time elapsed in the execution of the demo application,
-     * by the timer utility function that is provided to the MQTT library.
-     */
-    ulGlobalEntryTimeMs = prvGetTimeMs();
+/**
+ * @brief Telemetry batch being filled, see mqttexampleBATCH_MAX_SAMPLES.
+ */
+static uint8_t ucBatch[ mqttexampleBATCH_HEADER_SIZE + mqttexampleBATCH_MAX_SAMPLES * mqttexampleBATCH_SAMPLE_SIZE ];
 
-    /**************************** Initialize. *****************************/
-    prvInitializeTopicBuffers();
+/**
+ * @brief Timestamp of the last sample in #ucBatch.
+ */
+static uint16_t usBatchLastTime;
 
-    /****************************** Connect. ******************************/
-    xNetworkStatus = esp8266AT_Connect(democonfigMQTT_BROKER_ENDPOINT, democonfigMQTT_BROKER_PORT);
-    configASSERT(xNetworkStatus == ESP8266_TRANSPORT_SUCCESS);
+/**
+ * @brief Position of the MQTT task in the sensor sample ring.
+ */
+static uint16_t usSampleCursor;
 
-    /* Send an MQTT CONNECT packet over the established TLS connection,
-     * and wait for the connection acknowledgment (CONNACK) packet. */
-    prvCreateMQTTConnectionWithBroker( &xMQTTContext, NULL );
+/**
+ * @brief Backlog batch waiting for its PUBACK, MQTT_PACKET_ID_INVALID when
+ * none is, and the log records it holds.
+ */
+static uint16_t usBacklogPacketId = MQTT_PACKET_ID_INVALID;
+static uint16_t usBacklogFirstSeq;
+static uint8_t ucBacklogCount;
 
-    /**************************** Subscribe. ******************************/
-    /* If the server rejected the subscription request, attempt to resubscribe to the
-     * topic. Attempts are made according to the exponential backoff retry strategy
-     * implemented in BackoffAlgorithm. */
-    prvMQTTSubscribeWithBackoffRetries( &xMQTTContext );
+#endif
 
+/**
+ * @brief Receive side packet framing for #prvStreamingRecv.
+ */
+typedef struct streamContext
+{
+    uint8_t ucHeader[ 5 ];   /* Fixed header of the current packet. */
+    uint8_t ucHeaderLength;  /* Bytes of ucHeader read from the transport. */
+    uint8_t ucHeaderSent;    /* Bytes of ucHeader passed on to coreMQTT. */
+    bool xHeaderDone;        /* Remaining length is complete. */
+    uint32_t ulRemaining;    /* Bytes after the fixed header not read yet. */
+} streamContext_t;
+
+static streamContext_t xStream;
+
+/**
+ * @brief One copy per outgoing publish record, see #prvResendPublishes.
+ */
+static publishCopy_t xPublishCopies[ mqttexampleOUTGOING_PUBLISH_RECORD_LEN ];
+
+_Static_assert( mqttexampleOUTGOING_PUBLISH_RECORD_LEN <= 8U,
+                "prvResendPublishes tracks the copies in a uint8_t" );
+
+/**
+ * @brief A publish could not be sent, #MQTTtask has to reconnect.
+ */
+static bool xConnectionLost = false;
+
+/**
+ * @brief Command being collected by #prvTokenizeCommands, it may span chunks.
+ * A length above mqttexampleCOMMAND_MAX_LEN marks a command too long to match.
+ */
+static char cCommand[ mqttexampleCOMMAND_MAX_LEN ];
+static uint8_t ucCommandLength;
+
+/**
+ * @brief Time of the last run time statistics record.
+ */
+static uint32_t ulDiagLastTimeMs;
+
+/*
+ * @brief The Example shown below uses MQTT APIs to create MQTT messages and
+ * send them over the server-authenticated network connection established with the
+ * MQTT broker. This example is single-threaded and uses statically allocated
+ * memory. It uses QoS2 for sending and receiving messages from the broker.
+ *
+ * This MQTT client subscribes to the topic as specified in mqttexampleTOPIC at the
+ * top of this file by sending a subscribe packet and waiting for a subscribe
+ * acknowledgment (SUBACK) from the broker. The client will then publish to the
+ * same topic it subscribed to, therefore expecting that all outgoing messages will be
+ * sent back from the broker.
+ */
+void MQTTtask( void * pvParameters )
+{
+    MQTTContext_t xMQTTContext = { 0 };
+    NetworkContext_t xNetworkContext = { &xMQTTContext };
+    connectionState_t eState = eStateNoTransport;
+    uint16_t usBackOffMs = mqttexampleRETRY_BACKOFF_BASE_MS;
+    bool xSessionPresent = false;
+    MQTTStatus_t xResult;
+    uint32_t ulEvents = 0;
+
+    app_data = (app_data_handle_t*) pvParameters;
+
+    /**************************** Initialize. *****************************/
+    /* Wake up on every complete payload the transport receives. */
+    esp8266AT_SetRxNotify( xTaskGetCurrentTaskHandle(), APP_EVENT_NETWORK_RX );
+
+    prvInitializeMQTT( &xMQTTContext, &xNetworkContext );
+
+    /* The transport or the broker going away only sends the task back to
+     * eStateNoTransport. The broker keeps the session (cleanSession = false),
+     * so the subscription and the publishes in flight survive a reconnect. */
     for( ; ; )
     {
+        switch( eState )
+        {
+            case eStateNoTransport:
+
+                if( esp8266AT_Connect( democonfigMQTT_BROKER_ENDPOINT, democonfigMQTT_BROKER_PORT ) == ESP8266_TRANSPORT_SUCCESS )
+                {
+                    eState = eStateTransportUp;
+                }
+                else
+                {
+                    /* The access point may still be away. */
+                    prvBackOff( &usBackOffMs );
+                }
+
+                break;
+
+            case eStateTransportUp:
+
+                /* Send an MQTT CONNECT packet over the established TCP connection,
+                 * and wait for the connection acknowledgment (CONNACK) packet. */
+                if( prvCreateMQTTConnectionWithBroker( &xMQTTContext, &xSessionPresent ) == MQTTSuccess )
+                {
+                    eState = eStateSessionOpen;
+                }
+                else
+                {
+                    prvDropConnection( &xMQTTContext );
+                    prvBackOff( &usBackOffMs );
+                    eState = eStateNoTransport;
+                }
+
+                break;
+
+            case eStateSessionOpen:
+
+                /* A resumed session still holds the subscription, only a new
+                 * one needs the SUBSCRIBE. */
+                if( ( xSessionPresent || prvMQTTSubscribeWithBackoffRetries( &xMQTTContext ) ) &&
+                    prvResendPublishes( &xMQTTContext, xSessionPresent ) )
+                {
+                    usBackOffMs = mqttexampleRETRY_BACKOFF_BASE_MS;
+#if HCSR04_SAMPLE_RATE_HZ
+                    /* Samples taken while offline are in the EEPROM log,
+                     * prvDrainLog sends them. */
+                    taskENTER_CRITICAL();
+                    usSampleCursor = app_data->sample_count;
+                    taskEXIT_CRITICAL();
+#endif
+                    app_data->mqtt_online = 1;
+                    eState = eStateOnline;
+                }
+                else
+                {
+                    prvDropConnection( &xMQTTContext );
+                    prvBackOff( &usBackOffMs );
+                    eState = eStateNoTransport;
+                }
+
+                break;
+
+            case eStateOnline:
+
+                /* Sleep until the transport has a payload for us, the sensor has a
+                 * reading, or the keep-alive or the diagnostics need servicing. */
+                ( void ) xTaskNotifyWait( 0, APP_EVENT_ALL, &ulEvents, prvTicksToKeepAlive( &xMQTTContext ) );
 
 #ifdef  DEBUG_LED
-        digitalIOToggle(mLED);
+                digitalIOToggle(mLED);
+#endif
+
+#if HCSR04_SAMPLE_RATE_HZ
+                /* Woken every few samples by the sensor task, and the age limit of
+                 * the batch is checked on any other wake up too. */
+                prvCollectSamples( &xMQTTContext );
+                prvDrainLog( &xMQTTContext );
+#else
+                if( ( ulEvents & APP_EVENT_SENSOR_READY ) && xUpdatePending )
+                {
+                    xUpdatePending = false;
+                    prvMQTTPublishToTopics( &xMQTTContext, ucUpdateSeq );
+                }
 #endif
 
-        prvProcessLoopWithTimeout(&xMQTTContext, mqttexamplePROCESS_LOOP_TIMEOUT_MS); 
-        vTaskDelay(pdMS_TO_TICKS(200));
+                prvPublishDiagnostics( &xMQTTContext );
+
+                xResult = prvProcessPendingPackets( &xMQTTContext );
+                ulEvents = 0;
+
+                /* Send or receive failures, a missing PINGRESP or a CLOSED from
+                 * the ESP8266 all end up here. Reconnect right away, the back-off
+                 * only starts if that fails. */
+                if( xConnectionLost ||
+                    ( ( xResult != MQTTSuccess ) && ( xResult != MQTTNeedMoreBytes ) ) )
+                {
+                    prvDropConnection( &xMQTTContext );
+                    eState = eStateNoTransport;
+                }
+
+                break;
+        }
     }
 }
 /*-----------------------------------------------------------*/
 
-static void prvCreateMQTTConnectionWithBroker( MQTTContext_t * pxMQTTContext,
-                                               NetworkContext_t * pxNetworkContext )
+static void prvInitializeMQTT( MQTTContext_t * pxMQTTContext,
+                               NetworkContext_t * pxNetworkContext )
 {
     MQTTStatus_t xResult;
-    MQTTConnectInfo_t xConnectInfo;
-    bool xSessionPresent;
     TransportInterface_t xTransport;
 
-    /***
-     * For readability, error handling in this function is restricted to the use of
-     * asserts().
-     ***/
-
     /* Fill in Transport Interface send and receive function pointers. */
     xTransport.pNetworkContext = pxNetworkContext;
     xTransport.send = esp8266AT_send;
-    xTransport.recv = esp8266AT_recv;
-    xTransport.writev = NULL;
+    xTransport.recv = prvStreamingRecv;
+    xTransport.writev = esp8266AT_writev;
 
     /* Initialize MQTT library. */
     xResult = MQTT_Init( pxMQTTContext, &xTransport, prvGetTimeMs, prvEventCallback, &xBuffer );
@@ -495,15 +1175,26 @@ static void prvCreateMQTTConnectionWithBroker( MQTTContext_t * pxMQTTContext,
                                     pIncomingPublishRecords,
                                     mqttexampleINCOMING_PUBLISH_RECORD_LEN );
     configASSERT( xResult == MQTTSuccess );
+}
+/*-----------------------------------------------------------*/
+
+static MQTTStatus_t prvCreateMQTTConnectionWithBroker( MQTTContext_t * pxMQTTContext,
+                                                       bool * pxSessionPresent )
+{
+    MQTTConnectInfo_t xConnectInfo;
+
+    /* Whatever was left of a packet on the old connection is gone. */
+    ( void ) memset( ( void * ) &xStream, 0x00, sizeof( xStream ) );
+    ucCommandLength = 0;
 
     /* Some fields are not used in this demo so start with everything at 0. */
     ( void ) memset( ( void * ) &xConnectInfo, 0x00, sizeof( xConnectInfo ) );
 
-    /* Start with a clean session i.e. direct the MQTT broker to discard any
-     * previous session data. Also, establishing a connection with clean session
-     * will ensure that the broker does not store any data when this client
-     * gets disconnected. */
-    xConnectInfo.cleanSession = true;
+    /* Ask the broker to keep the session: the subscription and the QoS1/QoS2
+     * messages in flight, both ways, outlive a dropped connection. A broker
+     * that lost it answers with session present cleared, and coreMQTT then
+     * clears its publish records too. */
+    xConnectInfo.cleanSession = false;
 
     /* The client identifier is used to uniquely identify this MQTT client to
      * the MQTT broker. In a production device the identifier can be something
@@ -517,14 +1208,165 @@ static void prvCreateMQTTConnectionWithBroker( MQTTContext_t * pxMQTTContext,
 
     /* Send MQTT CONNECT packet to broker. LWT is not used in this demo, so it
      * is passed as NULL. */
-    xResult = MQTT_Connect( pxMQTTContext,
-                            &xConnectInfo,
-                            NULL,
-                            mqttexampleCONNACK_RECV_TIMEOUT_MS,
-                            &xSessionPresent );
-    configASSERT( xResult == MQTTSuccess );
+    return MQTT_Connect( pxMQTTContext,
+                         &xConnectInfo,
+                         NULL,
+                         mqttexampleCONNACK_RECV_TIMEOUT_MS,
+                         pxSessionPresent );
+}
+/*-----------------------------------------------------------*/
+
+static bool prvResendPublishes( MQTTContext_t * pxMQTTContext,
+                                bool xSessionPresent )
+{
+    MQTTStateCursor_t xCursor = MQTT_STATE_CURSOR_INITIALIZER;
+    publishCopy_t * pxCopy;
+    uint16_t usPacketId;
+    uint8_t ucResent = 0U;
+    uint8_t ucIndex;
+
+#if HCSR04_SAMPLE_RATE_HZ
+    bool xBacklogResent = false;
+#endif
+
+    if( xSessionPresent )
+    {
+        /* MQTT_Connect has already sent the pending PUBRELs again. Publishes
+         * still waiting for their PUBACK or PUBREC go out with the same packet
+         * id and the DUP flag set. */
+        while( ( usPacketId = MQTT_PublishToResend( pxMQTTContext, &xCursor ) ) != MQTT_PACKET_ID_INVALID )
+        {
+#if HCSR04_SAMPLE_RATE_HZ
+            /* The backlog batch is built again from the log, it is still
+             * there until the PUBACK. */
+            if( usPacketId == usBacklogPacketId )
+            {
+                if( prvSendBacklog( pxMQTTContext, usPacketId, true ) != MQTTSuccess )
+                {
+                    return false;
+                }
+
+                xBacklogResent = true;
+                continue;
+            }
+#endif
+
+            pxCopy = prvFindCopy( usPacketId );
+
+            if( pxCopy != NULL )
+            {
+                if( prvSendCopy( pxMQTTContext, pxCopy, true ) != MQTTSuccess )
+                {
+                    return false;
+                }
+
+                ucResent |= ( uint8_t ) ( 1U << ( pxCopy - xPublishCopies ) );
+            }
+        }
+    }
+
+#if HCSR04_SAMPLE_RATE_HZ
+    /* Not in the session, prvDrainLog sends the records again. */
+    if( !xBacklogResent )
+    {
+        usBacklogPacketId = MQTT_PACKET_ID_INVALID;
+    }
+#endif
+
+    /* What is left never made it out in full, or the broker started a new
+     * session and has forgotten all of them: take new packet ids then. */
+    for( ucIndex = 0; ucIndex < mqttexampleOUTGOING_PUBLISH_RECORD_LEN; ucIndex++ )
+    {
+        pxCopy = &xPublishCopies[ ucIndex ];
+
+        if( ( pxCopy->usPacketId == MQTT_PACKET_ID_INVALID ) || ( ucResent & ( 1U << ucIndex ) ) )
+        {
+            continue;
+        }
+
+        if( !xSessionPresent )
+        {
+            pxCopy->usPacketId = MQTT_GetPacketId( pxMQTTContext );
+        }
+
+        if( prvSendCopy( pxMQTTContext, pxCopy, xSessionPresent ) != MQTTSuccess )
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+/*-----------------------------------------------------------*/
+
+static void prvDropConnection( MQTTContext_t * pxMQTTContext )
+{
+    /* DISCONNECT if the link still works. On a dead link the send fails and
+     * coreMQTT is left connected or MQTTDisconnectPending, which would refuse
+     * the next CONNECT: put it back to MQTTNotConnected. The publish records
+     * stay untouched either way. */
+    if( MQTT_Disconnect( pxMQTTContext ) != MQTTSuccess )
+    {
+        pxMQTTContext->connectStatus = MQTTNotConnected;
+    }
+
+    ( void ) esp8266AT_Disconnect();
+    xConnectionLost = false;
+
+    /* hcsr04_task logs to the EEPROM until the broker is back. */
+    app_data->mqtt_online = 0;
+}
+/*-----------------------------------------------------------*/
+
+static void prvBackOff( uint16_t * pusBackOffMs )
+{
+    vTaskDelay( pdMS_TO_TICKS( *pusBackOffMs ) );
+
+    if( *pusBackOffMs < ( mqttexampleRETRY_MAX_BACKOFF_DELAY_MS / 2U ) )
+    {
+        *pusBackOffMs *= 2U;
+    }
+    else
+    {
+        *pusBackOffMs = mqttexampleRETRY_MAX_BACKOFF_DELAY_MS;
+    }
+}
+/*-----------------------------------------------------------*/
+
+static publishCopy_t * prvFindCopy( uint16_t usPacketId )
+{
+    uint8_t ucIndex;
+
+    for( ucIndex = 0; ucIndex < mqttexampleOUTGOING_PUBLISH_RECORD_LEN; ucIndex++ )
+    {
+        if( xPublishCopies[ ucIndex ].usPacketId == usPacketId )
+        {
+            return &xPublishCopies[ ucIndex ];
+        }
+    }
+
+    return NULL;
+}
+/*-----------------------------------------------------------*/
+
+static MQTTStatus_t prvSendCopy( MQTTContext_t * pxMQTTContext,
+                                 const publishCopy_t * pxCopy,
+                                 bool xDup )
+{
+    MQTTPublishInfo_t xMQTTPublishInfo;
 
-    /* Successfully established and MQTT connection with the broker. */
+    ( void ) memset( ( void * ) &xMQTTPublishInfo, 0x00, sizeof( xMQTTPublishInfo ) );
+
+    xMQTTPublishInfo.qos = prvTopicQoS( pxCopy->pcTopic );
+    xMQTTPublishInfo.dup = xDup;
+    xMQTTPublishInfo.pTopicName = pxCopy->pcTopic;
+    xMQTTPublishInfo.topicNameLength = ( uint16_t ) strlen( pxCopy->pcTopic );
+    xMQTTPublishInfo.pPayload = pxCopy->ucPayload;
+    xMQTTPublishInfo.payloadLength = pxCopy->ucLength;
+
+    /* A duplicate of a publish coreMQTT still has a record for is accepted
+     * with the same packet id. */
+    return MQTT_Publish( pxMQTTContext, &xMQTTPublishInfo, pxCopy->usPacketId );
 }
 /*-----------------------------------------------------------*/
 
@@ -541,21 +1383,23 @@ static void prvUpdateSubAckStatus( MQTTPacketInfo_t * pxPacketInfo )
      * from the event callback and non-NULL parameters. */
     configASSERT( xResult == MQTTSuccess );
 
-    for( ulTopicCount = 0; ulTopicCount < ulSize; ulTopicCount++ )
+    for( ulTopicCount = 0; ( ulTopicCount < ulSize ) && ( ulTopicCount < mqttexampleTOPIC_COUNT ); ulTopicCount++ )
     {
-        xTopicFilterContext[ ulTopicCount ].xSubAckStatus = pucPayload[ ulTopicCount ];
+        xSubAckStatus[ ulTopicCount ] = pucPayload[ ulTopicCount ];
     }
 }
 /*-----------------------------------------------------------*/
 
-static void prvMQTTSubscribeWithBackoffRetries( MQTTContext_t * pxMQTTContext )
+static bool prvMQTTSubscribeWithBackoffRetries( MQTTContext_t * pxMQTTContext )
 {
     MQTTStatus_t xResult = MQTTSuccess;
     uint8_t counter = mqttexampleRETRY_MAX_ATTEMPTS;
     uint16_t usNextRetryBackOff = mqttexampleRETRY_BACKOFF_BASE_MS;
     MQTTSubscribeInfo_t xMQTTSubscription[ mqttexampleTOPIC_COUNT ];
+    subscription_t xSubscription;
     bool xFailedSubscribeToTopic = false;
     uint32_t ulTopicCount = 0U;
+    uint8_t ucSlot;
 
     /* Some fields not used by this demo so start with everything at 0. */
     ( void ) memset( ( void * ) &xMQTTSubscription, 0x00, sizeof( xMQTTSubscription ) );
@@ -564,11 +1408,25 @@ static void prvMQTTSubscribeWithBackoffRetries( MQTTContext_t * pxMQTTContext )
     usSubscribePacketIdentifier = MQTT_GetPacketId( pxMQTTContext );
 
     /* Populate subscription list. */
-    for( ulTopicCount = 0; ulTopicCount < mqttexampleTOPIC_COUNT; ulTopicCount++ )
+    for( ucSlot = 0; ucSlot < mqttexampleTOPIC_SLOTS; ucSlot++ )
     {
-        xMQTTSubscription[ ulTopicCount ].qos = MQTTQoS2;
-        xMQTTSubscription[ ulTopicCount ].pTopicFilter = xTopicFilterContext[ ulTopicCount ].pcTopicFilter;
-        xMQTTSubscription[ ulTopicCount ].topicFilterLength = ( uint16_t ) strlen( xTopicFilterContext[ ulTopicCount ].pcTopicFilter );
+        ( void ) memcpy_P( &xSubscription, &xSubscriptions[ ucSlot ], sizeof( xSubscription ) );
+
+        if( xSubscription.ucLength == 0U )
+        {
+            continue;
+        }
+
+        /* A wrong key in mqttexampleSUBSCRIPTIONS puts the topic on a slot
+         * its publishes are never looked up at. */
+        configASSERT( mqttexampleSLOT( xSubscription.ucLength,
+                                       prvTopicKey( xSubscription.pcTopic, xSubscription.ucLength ),
+                                       mqttexampleTOPIC_SLOTS ) == ucSlot );
+
+        xMQTTSubscription[ ulTopicCount ].qos = prvTopicQoS( xSubscription.pcTopic );
+        xMQTTSubscription[ ulTopicCount ].pTopicFilter = xSubscription.pcTopic;
+        xMQTTSubscription[ ulTopicCount ].topicFilterLength = xSubscription.ucLength;
+        xSubAckStatus[ ulTopicCount++ ] = MQTTSubAckFailure;
     }
 
     do
@@ -578,13 +1436,17 @@ static void prvMQTTSubscribeWithBackoffRetries( MQTTContext_t * pxMQTTContext )
          * subscribe packet then waiting for a subscribe acknowledgment (SUBACK).
          * This client will then publish to the same topic it subscribed to, so it
          * will expect all the messages it sends to the broker to be sent back to it
-         * from the broker. This demo uses QOS2 in Subscribe, therefore, the Publish
-         * messages received from the broker will have QOS2. */
+         * from the broker. The subscription QoS comes from #xTopicQoS, the Publish
+         * messages received from the broker will have at most that QoS. */
         xResult = MQTT_Subscribe( pxMQTTContext,
                                   xMQTTSubscription,
                                   sizeof( xMQTTSubscription ) / sizeof( MQTTSubscribeInfo_t ),
                                   usSubscribePacketIdentifier );
-        configASSERT( xResult == MQTTSuccess );
+
+        if( xResult != MQTTSuccess )
+        {
+            return false;
+        }
 
         /* Process incoming packet from the broker. After sending the subscribe, the
          * client may receive a publish before it receives a subscribe ack. Therefore,
@@ -594,18 +1456,22 @@ static void prvMQTTSubscribeWithBackoffRetries( MQTTContext_t * pxMQTTContext )
          * must be ready to receive any packet.  This demo uses the generic packet
          * processing function everywhere to highlight this fact. */
         xResult = prvProcessLoopWithTimeout( pxMQTTContext, mqttexamplePROCESS_LOOP_TIMEOUT_MS );
-        configASSERT( xResult == MQTTSuccess );
+
+        if( ( xResult != MQTTSuccess ) && ( xResult != MQTTNeedMoreBytes ) )
+        {
+            return false;
+        }
 
         /* Reset flag before checking suback responses. */
         xFailedSubscribeToTopic = false;
 
-        /* Check if recent subscription request has been rejected. #xTopicFilterContext is updated
+        /* Check if recent subscription request has been rejected. #xSubAckStatus is updated
          * in the event callback to reflect the status of the SUBACK sent by the broker. It represents
          * either the QoS level granted by the server upon subscription, or acknowledgement of
          * server rejection of the subscription request. */
         for( ulTopicCount = 0; ulTopicCount < mqttexampleTOPIC_COUNT; ulTopicCount++ )
         {
-            if( xTopicFilterContext[ ulTopicCount ].xSubAckStatus == MQTTSubAckFailure )
+            if( xSubAckStatus[ ulTopicCount ] == MQTTSubAckFailure )
             {
                 xFailedSubscribeToTopic = true;
 
@@ -626,99 +1492,385 @@ static void prvMQTTSubscribeWithBackoffRetries( MQTTContext_t * pxMQTTContext )
             }
         }
     } while( ( xFailedSubscribeToTopic == true ) && ( counter ) );
+
+    /* A rejected subscription does not get better by reconnecting. */
+    return true;
 }
 /*-----------------------------------------------------------*/
 
-static void prvMQTTPublishToTopics( MQTTContext_t *pxMQTTContext )
+static void prvMQTTPublishToTopics( MQTTContext_t *pxMQTTContext,
+                                    uint8_t ucSeq )
 {
-    MQTTStatus_t xResult;
-    MQTTPublishInfo_t xMQTTPublishInfo;
-    //char msg[5];
+    hcsr04_sample_t xSample = { 0 };
+    uint8_t ucStatus = APP_STATUS_OK;
 
-    /***
-     * For readability, error handling in this function is restricted to the use of
-     * asserts().
-     ***/
+    /* Copy the newest sample, hcsr04_task may store a new one while this
+     * packet is being sent. */
+    if( hcsr04LatestSample( app_data, &xSample ) == pdFALSE )
+    {
+        ucStatus = APP_STATUS_NO_DATA;
+    }
 
-    //snprintf(msg, 5, "%u", data);
+    prvPublishFrame( pxMQTTContext, APP_OP_READING, ucSeq, ucStatus, ( uint16_t ) xSample.value );
+}
+/*-----------------------------------------------------------*/
 
-    /* Some fields are not used by this demo so start with everything at 0. */
-    ( void ) memset( ( void * ) &xMQTTPublishInfo, 0x00, sizeof( xMQTTPublishInfo ) );
+static void prvPublishFrame( MQTTContext_t * pxMQTTContext,
+                             uint8_t ucOpcode,
+                             uint8_t ucSeq,
+                             uint8_t ucArg,
+                             uint16_t usValue )
+{
+    app_frame_t xFrame = { ucOpcode, ucSeq, ucArg, usValue };
+    uint8_t ucFrame[ APP_FRAME_SIZE ];
 
-    /* This demo uses QoS2 */
-    xMQTTPublishInfo.qos = MQTTQoS2;
-    xMQTTPublishInfo.retain = false;
-    xMQTTPublishInfo.pTopicName = mqttexampleTX_TOPIC_NAME;
-    xMQTTPublishInfo.topicNameLength = ( uint16_t ) strlen( xMQTTPublishInfo.pTopicName );
-    xMQTTPublishInfo.pPayload = &(app_data->sensor_read);
-    xMQTTPublishInfo.payloadLength = sizeof(hcsr04_data_t);
+    appFrameEncode( &xFrame, ucFrame );
+    prvPublish( pxMQTTContext, mqttexampleTX_TOPIC_NAME, ucFrame, sizeof( ucFrame ) );
+}
+/*-----------------------------------------------------------*/
 
-    /* Get a unique packet id. */
-    usPublishPacketIdentifier = MQTT_GetPacketId( pxMQTTContext );
+static void prvPublishDiagnostics( MQTTContext_t * pxMQTTContext )
+{
+    TaskHandle_t xTasks[ RUNTIME_STATS_MAX_TASKS ];
+    uint8_t ucRecord[ RUNTIME_STATS_RECORD_SIZE( RUNTIME_STATS_MAX_TASKS ) ];
+    size_t xLength;
+    uint32_t ulNow = prvGetTimeMs();
 
-    /* Send PUBLISH packet. */
-    xResult = MQTT_Publish( pxMQTTContext, &xMQTTPublishInfo, usPublishPacketIdentifier );
-    configASSERT( xResult == MQTTSuccess );
+    if( ( ulNow - ulDiagLastTimeMs ) < mqttexampleDIAG_PERIOD_MS )
+    {
+        return;
+    }
+
+    ulDiagLastTimeMs = ulNow;
+
+    xTasks[ 0 ] = app_data->mqtt_task;
+    xTasks[ 1 ] = app_data->sensor_task;
+    xTasks[ 2 ] = esp8266AT_RxTask();
+    xTasks[ 3 ] = xTaskGetIdleTaskHandle();
+
+    xLength = runtimeStatsRecord( xTasks, RUNTIME_STATS_MAX_TASKS, ucRecord );
+    prvPublish( pxMQTTContext, mqttexampleDIAG_TOPIC_NAME, ucRecord, xLength );
 }
 /*-----------------------------------------------------------*/
 
-#if 0
-static void prvMQTTUnsubscribeFromTopics( MQTTContext_t * pxMQTTContext )
+static void prvPublish( MQTTContext_t * pxMQTTContext,
+                        const char * pcTopic,
+                        const void * pvPayload,
+                        size_t xLength )
 {
     MQTTStatus_t xResult;
-    MQTTSubscribeInfo_t xMQTTSubscription[ mqttexampleTOPIC_COUNT ];
-    uint32_t ulTopicCount;
+    MQTTPublishInfo_t xMQTTPublishInfo;
+    publishCopy_t * pxCopy;
 
     /* Some fields are not used by this demo so start with everything at 0. */
-    memset( ( void * ) &xMQTTSubscription, 0x00, sizeof( xMQTTSubscription ) );
+    ( void ) memset( ( void * ) &xMQTTPublishInfo, 0x00, sizeof( xMQTTPublishInfo ) );
 
-    /* Populate subscription list. */
-    for( ulTopicCount = 0; ulTopicCount < mqttexampleTOPIC_COUNT; ulTopicCount++ )
+    xMQTTPublishInfo.qos = prvTopicQoS( pcTopic );
+    xMQTTPublishInfo.retain = false;
+    xMQTTPublishInfo.pTopicName = pcTopic;
+    xMQTTPublishInfo.topicNameLength = ( uint16_t ) strlen( pcTopic );
+    xMQTTPublishInfo.pPayload = pvPayload;
+    xMQTTPublishInfo.payloadLength = xLength;
+
+    if( xMQTTPublishInfo.qos == MQTTQoS0 )
     {
-        xMQTTSubscription[ ulTopicCount ].qos = MQTTQoS2;
-        xMQTTSubscription[ ulTopicCount ].pTopicFilter = xTopicFilterContext[ ulTopicCount ].pcTopicFilter;
-        xMQTTSubscription[ ulTopicCount ].topicFilterLength = ( uint16_t ) strlen( xTopicFilterContext[ ulTopicCount ].pcTopicFilter );
+        /* Fast path: no packet id, no outgoing publish record and nothing to
+         * wait for. A lost telemetry packet is replaced by the next one, it
+         * is only a sign the connection is gone. */
+        if( MQTT_Publish( pxMQTTContext, &xMQTTPublishInfo, 0U ) == MQTTSendFailed )
+        {
+            xConnectionLost = true;
+        }
 
-        //LogInfo( ( "Unsubscribing from topic %s.\r\n", xTopicFilterContext[ ulTopicCount ].pcTopicFilter ) );
+        return;
     }
 
-    /* Get next unique packet identifier. */
-    usUnsubscribePacketIdentifier = MQTT_GetPacketId( pxMQTTContext );
-    /* Make sure the packet id obtained is valid. */
-    configASSERT( usUnsubscribePacketIdentifier != 0 );
+    /* Get a unique packet id. */
+    usPublishPacketIdentifier = MQTT_GetPacketId( pxMQTTContext );
 
-    /* Send UNSUBSCRIBE packet. */
-    xResult = MQTT_Unsubscribe( pxMQTTContext,
-                                xMQTTSubscription,
-                                sizeof( xMQTTSubscription ) / sizeof( MQTTSubscribeInfo_t ),
-                                usUnsubscribePacketIdentifier );
+    /* Keep a copy until the PUBACK or PUBREC, #prvResendPublishes sends it
+     * again after a reconnect. */
+    pxCopy = prvFindCopy( MQTT_PACKET_ID_INVALID );
 
-    configASSERT( xResult == MQTTSuccess );
+    if( ( pxCopy != NULL ) && ( xLength <= sizeof( pxCopy->ucPayload ) ) )
+    {
+        pxCopy->usPacketId = usPublishPacketIdentifier;
+        pxCopy->pcTopic = pcTopic;
+        pxCopy->ucLength = ( uint8_t ) xLength;
+        ( void ) memcpy( pxCopy->ucPayload, pvPayload, xLength );
+    }
+    else
+    {
+        pxCopy = NULL;
+    }
+
+    /* Send PUBLISH packet. */
+    xResult = MQTT_Publish( pxMQTTContext, &xMQTTPublishInfo, usPublishPacketIdentifier );
+
+    if( xResult == MQTTSendFailed )
+    {
+        xConnectionLost = true;
+    }
+    else if( ( xResult != MQTTSuccess ) && ( pxCopy != NULL ) )
+    {
+        /* Not taken at all, e.g. no free publish record. */
+        pxCopy->usPacketId = MQTT_PACKET_ID_INVALID;
+    }
 }
 /*-----------------------------------------------------------*/
-#endif
 
-static void prvMQTTProcessResponse( MQTTPacketInfo_t * pxIncomingPacket,
-                                    uint16_t usPacketId )
+static MQTTQoS_t prvTopicQoS( const char * pcTopic )
 {
-    switch( pxIncomingPacket->type )
+    uint8_t ucIndex;
+
+    for( ucIndex = 0; ucIndex < sizeof( xTopicQoS ) / sizeof( xTopicQoS[ 0 ] ); ucIndex++ )
     {
-        case MQTT_PACKET_TYPE_PUBACK:
-            break;
+        if( strcmp( xTopicQoS[ ucIndex ].pcTopic, pcTopic ) == 0 )
+        {
+            return xTopicQoS[ ucIndex ].xQoS;
+        }
+    }
 
-        case MQTT_PACKET_TYPE_SUBACK:
+    return MQTTQoS0;
+}
+/*-----------------------------------------------------------*/
 
-            /* A SUBACK from the broker, containing the server response to our subscription request, has been received.
-             * It contains the status code indicating server approval/rejection for the subscription to the single topic
-             * requested. The SUBACK will be parsed to obtain the status code, and this status code will be stored in global
-             * variable #xTopicFilterContext. */
-            prvUpdateSubAckStatus( pxIncomingPacket );
+#if HCSR04_SAMPLE_RATE_HZ
 
-            /* Make sure ACK packet identifier matches with Request packet identifier. */
-            configASSERT( usSubscribePacketIdentifier == usPacketId );
-            break;
+static void prvCollectSamples( MQTTContext_t * pxMQTTContext )
+{
+    hcsr04_sample_t xSample;
+
+    while( hcsr04ReadSamples( app_data, &usSampleCursor, &xSample, 1 ) > 0 )
+    {
+        /* Readings the sensor task rejected leave gaps. One the delta byte
+         * cannot hold starts a new batch with its own base. */
+        if( ( ucBatch[ 0 ] > 0U ) &&
+            ( ( uint16_t ) ( ( uint16_t ) xSample.timestamp - usBatchLastTime ) > 0xFFU ) )
+        {
+            prvPublishBatch( pxMQTTContext );
+        }
+
+        if( prvBatchAdd( ( uint16_t ) xSample.timestamp, 1U, xSample.value ) )
+        {
+            break;
+        }
+    }
+
+    if( ( ucBatch[ 0 ] == mqttexampleBATCH_MAX_SAMPLES ) ||
+        ( ( ucBatch[ 0 ] > 0U ) &&
+          ( ( uint16_t ) ( ( uint16_t ) ulPortGetTimeMs() - ( uint16_t ) ( ucBatch[ 2 ] | ( ucBatch[ 3 ] << 8 ) ) ) >=
+            mqttexampleBATCH_MAX_AGE_MS ) ) )
+    {
+        prvPublishBatch( pxMQTTContext );
+    }
+}
+/*-----------------------------------------------------------*/
+
+static void prvPublishBatch( MQTTContext_t * pxMQTTContext )
+{
+    prvPublish( pxMQTTContext, mqttexampleTELEMETRY_TOPIC_NAME, ucBatch,
+                mqttexampleBATCH_HEADER_SIZE + ucBatch[ 0 ] * mqttexampleBATCH_SAMPLE_SIZE );
+    ucBatch[ 0 ] = 0;
+}
+/*-----------------------------------------------------------*/
+
+static bool prvBatchAdd( uint16_t usTimestamp,
+                         uint8_t ucUnitMs,
+                         hcsr04_data_t xValue )
+{
+    uint16_t usDelta;
+    uint8_t * pucSlot;
+
+    if( ucBatch[ 0 ] == 0U )
+    {
+        ucBatch[ 1 ] = ucUnitMs;
+        ucBatch[ 2 ] = ( uint8_t ) usTimestamp;
+        ucBatch[ 3 ] = ( uint8_t ) ( usTimestamp >> 8 );
+        usDelta = 0;
+    }
+    else
+    {
+        usDelta = usTimestamp - usBatchLastTime;
+    }
+
+    usBatchLastTime = usTimestamp;
+    pucSlot = &ucBatch[ mqttexampleBATCH_HEADER_SIZE + ucBatch[ 0 ] * mqttexampleBATCH_SAMPLE_SIZE ];
+    pucSlot[ 0 ] = ( usDelta > 0xFFU ) ? 0xFFU : ( uint8_t ) usDelta;
+    pucSlot[ 1 ] = ( uint8_t ) xValue;
+    pucSlot[ 2 ] = ( uint8_t ) ( xValue >> 8 );
+
+    return ++ucBatch[ 0 ] == mqttexampleBATCH_MAX_SAMPLES;
+}
+/*-----------------------------------------------------------*/
+
+static void prvDrainLog( MQTTContext_t * pxMQTTContext )
+{
+    uint16_t usPacketId;
+    MQTTStatus_t xResult;
+
+    /* The backlog batch borrows #ucBatch while no live batch is open. */
+    if( ( usBacklogPacketId != MQTT_PACKET_ID_INVALID ) ||
+        ( ucBatch[ 0 ] != 0U ) || ( ucEELogPending() == 0U ) )
+    {
+        return;
+    }
+
+    usPacketId = MQTT_GetPacketId( pxMQTTContext );
+    xResult = prvSendBacklog( pxMQTTContext, usPacketId, false );
+
+    /* A failed send may still hold a publish record, the reconnect sorts
+     * that out. The records stay in the log until the PUBACK. */
+    if( ( xResult == MQTTSuccess ) || ( xResult == MQTTSendFailed ) )
+    {
+        usBacklogPacketId = usPacketId;
+    }
+
+    if( xResult == MQTTSendFailed )
+    {
+        xConnectionLost = true;
+    }
+}
+/*-----------------------------------------------------------*/
+
+static MQTTStatus_t prvSendBacklog( MQTTContext_t * pxMQTTContext,
+                                    uint16_t usPacketId,
+                                    bool xDup )
+{
+    EELogRecord_t xRecord;
+    MQTTPublishInfo_t xMQTTPublishInfo;
+    MQTTStatus_t xResult;
+    uint8_t ucCount;
+
+    if( ucBatch[ 0 ] != 0U )
+    {
+        prvPublishBatch( pxMQTTContext );
+    }
+
+    for( ucCount = 0; ucCount < mqttexampleBATCH_MAX_SAMPLES; ucCount++ )
+    {
+        if( xEELogRead( ucCount, &xRecord ) == pdFALSE )
+        {
+            break;
+        }
+
+        if( ucCount == 0U )
+        {
+            usBacklogFirstSeq = xRecord.usSeq;
+        }
+
+        ( void ) prvBatchAdd( xRecord.usTimestamp, HCSR04_LOG_TIME_UNIT_MS, xRecord.usValue );
+    }
+
+    /* An empty batch still answers for the packet id on a resend. */
+    ucBacklogCount = ucCount;
+    ucBatch[ 0 ] = ucCount;
+
+    ( void ) memset( ( void * ) &xMQTTPublishInfo, 0x00, sizeof( xMQTTPublishInfo ) );
+
+    xMQTTPublishInfo.qos = mqttexampleBACKLOG_TOPIC_QOS;
+    xMQTTPublishInfo.dup = xDup;
+    xMQTTPublishInfo.pTopicName = mqttexampleBACKLOG_TOPIC_NAME;
+    xMQTTPublishInfo.topicNameLength = ( uint16_t ) strlen( mqttexampleBACKLOG_TOPIC_NAME );
+    xMQTTPublishInfo.pPayload = ucBatch;
+    xMQTTPublishInfo.payloadLength = mqttexampleBATCH_HEADER_SIZE + ucCount * mqttexampleBATCH_SAMPLE_SIZE;
+
+    xResult = MQTT_Publish( pxMQTTContext, &xMQTTPublishInfo, usPacketId );
+    ucBatch[ 0 ] = 0;
+
+    return xResult;
+}
+/*-----------------------------------------------------------*/
+
+#endif
+
+#if 0
+static void prvMQTTUnsubscribeFromTopics( MQTTContext_t * pxMQTTContext )
+{
+    MQTTStatus_t xResult;
+    MQTTSubscribeInfo_t xMQTTSubscription[ mqttexampleTOPIC_COUNT ];
+    subscription_t xSubscription;
+    uint32_t ulTopicCount = 0U;
+    uint8_t ucSlot;
+
+    /* Some fields are not used by this demo so start with everything at 0. */
+    memset( ( void * ) &xMQTTSubscription, 0x00, sizeof( xMQTTSubscription ) );
+
+    /* Populate subscription list. */
+    for( ucSlot = 0; ucSlot < mqttexampleTOPIC_SLOTS; ucSlot++ )
+    {
+        ( void ) memcpy_P( &xSubscription, &xSubscriptions[ ucSlot ], sizeof( xSubscription ) );
+
+        if( xSubscription.ucLength != 0U )
+        {
+            xMQTTSubscription[ ulTopicCount ].qos = MQTTQoS2;
+            xMQTTSubscription[ ulTopicCount ].pTopicFilter = xSubscription.pcTopic;
+            xMQTTSubscription[ ulTopicCount++ ].topicFilterLength = xSubscription.ucLength;
+        }
+    }
+
+    /* Get next unique packet identifier. */
+    usUnsubscribePacketIdentifier = MQTT_GetPacketId( pxMQTTContext );
+    /* Make sure the packet id obtained is valid. */
+    configASSERT( usUnsubscribePacketIdentifier != 0 );
+
+    /* Send UNSUBSCRIBE packet. */
+    xResult = MQTT_Unsubscribe( pxMQTTContext,
+                                xMQTTSubscription,
+                                sizeof( xMQTTSubscription ) / sizeof( MQTTSubscribeInfo_t ),
+                                usUnsubscribePacketIdentifier );
+
+    configASSERT( xResult == MQTTSuccess );
+}
+/*-----------------------------------------------------------*/
+#endif
+
+static void prvMQTTProcessResponse( MQTTPacketInfo_t * pxIncomingPacket,
+                                    uint16_t usPacketId )
+{
+    publishCopy_t * pxCopy;
+
+    switch( pxIncomingPacket->type )
+    {
+        case MQTT_PACKET_TYPE_PUBACK:
+        case MQTT_PACKET_TYPE_PUBREC:
+
+            /* The broker has the message, a resend would now be a PUBREL
+             * which coreMQTT takes care of. */
+#if HCSR04_SAMPLE_RATE_HZ
+            if( usPacketId == usBacklogPacketId )
+            {
+                if( ucBacklogCount > 0U )
+                {
+                    vEELogConsume( usBacklogFirstSeq, ucBacklogCount );
+                }
+                usBacklogPacketId = MQTT_PACKET_ID_INVALID;
+                break;
+            }
+#endif
+
+            pxCopy = prvFindCopy( usPacketId );
+
+            if( pxCopy != NULL )
+            {
+                pxCopy->usPacketId = MQTT_PACKET_ID_INVALID;
+            }
+
+            break;
+
+        case MQTT_PACKET_TYPE_SUBACK:
+
+            /* A SUBACK from the broker, containing the server response to our subscription request, has been received.
+             * It contains the status code indicating server approval/rejection for the subscription to the single topic
+             * requested. The SUBACK will be parsed to obtain the status code, and this status code will be stored in global
+             * variable #xSubAckStatus. */
+            prvUpdateSubAckStatus( pxIncomingPacket );
 
-        case MQTT_PACKET_TYPE_UNSUBACK:
+            /* Make sure ACK packet identifier matches with Request packet identifier. */
+            configASSERT( usSubscribePacketIdentifier == usPacketId );
+            break;
+
+        case MQTT_PACKET_TYPE_UNSUBACK:
             /* Make sure ACK packet identifier matches with Request packet identifier. */
             configASSERT( usUnsubscribePacketIdentifier == usPacketId );
             break;
@@ -729,9 +1881,6 @@ static void prvMQTTProcessResponse( MQTTPacketInfo_t * pxIncomingPacket,
              * PINGRESP with the use of MQTT_ProcessLoop API function. */
             break;
 
-        case MQTT_PACKET_TYPE_PUBREC:
-            break;
-
         case MQTT_PACKET_TYPE_PUBREL:
 
             /* Nothing to be done from application as library handles
@@ -752,32 +1901,220 @@ static void prvMQTTProcessResponse( MQTTPacketInfo_t * pxIncomingPacket,
 
 static void prvMQTTProcessIncomingPublish( MQTTContext_t * pxMQTTContext, MQTTPublishInfo_t * pxPublishInfo )
 {
+    subscription_t xSubscription;
+
     configASSERT( pxPublishInfo != NULL );
 
     /* Verify the received publish is for one of the topics that's been subscribed to. */
-    if( ( pxPublishInfo->topicNameLength == strlen( xTopicFilterContext[0].pcTopicFilter ) ) &&
-        ( strncmp( xTopicFilterContext[0].pcTopicFilter, pxPublishInfo->pTopicName, pxPublishInfo->topicNameLength ) == 0 ) )
+    if( prvFindSubscription( pxPublishInfo->topicNameLength,
+                             prvTopicKey( pxPublishInfo->pTopicName, pxPublishInfo->topicNameLength ),
+                             &xSubscription ) &&
+        ( memcmp( xSubscription.pcTopic, pxPublishInfo->pTopicName, xSubscription.ucLength ) == 0 ) )
     {
-        /* Verify the message received matches expected commands */
-
-        if( strncmp( "ON", ( const char * ) ( pxPublishInfo->pPayload ), pxPublishInfo->payloadLength ) == 0 )
+        if( appFrameIsBinary( pxPublishInfo->pPayload, pxPublishInfo->payloadLength ) )
+        {
+            if( xSubscription.pxFrame != NULL )
+            {
+                xSubscription.pxFrame( pxMQTTContext, pxPublishInfo->pPayload, pxPublishInfo->payloadLength );
+            }
+        }
+        else
         {
-            digitalIOSet(mLED_0, pdTRUE);
+            prvTokenizeCommands( pxMQTTContext, xSubscription.pxDispatch,
+                                 pxPublishInfo->pPayload, pxPublishInfo->payloadLength, true );
         }
+    }
+}
 
-        else if( strncmp( "OFF", ( const char * ) ( pxPublishInfo->pPayload ), pxPublishInfo->payloadLength ) == 0 )
+/*-----------------------------------------------------------*/
+
+static void prvTokenizeCommands( MQTTContext_t * pxMQTTContext,
+                                 commandDispatch_t pxDispatch,
+                                 const uint8_t * pucPayload,
+                                 size_t xLength,
+                                 bool xLast )
+{
+    size_t x;
+    char c;
+
+    for( x = 0; x < xLength; x++ )
+    {
+        c = ( char ) pucPayload[ x ];
+
+        if( ( c == ' ' ) || ( c == ',' ) || ( c == ';' ) || ( c == '\r' ) || ( c == '\n' ) || ( c == '\t' ) )
         {
-            digitalIOSet(mLED_0, pdFALSE);
+            if( ucCommandLength <= mqttexampleCOMMAND_MAX_LEN )
+            {
+                pxDispatch( pxMQTTContext, cCommand, ucCommandLength );
+            }
+
+            ucCommandLength = 0;
         }
+        else if( ucCommandLength < mqttexampleCOMMAND_MAX_LEN )
+        {
+            cCommand[ ucCommandLength++ ] = c;
+        }
+        else
+        {
+            /* Too long, skip it up to the next separator. */
+            ucCommandLength = mqttexampleCOMMAND_MAX_LEN + 1U;
+        }
+    }
 
-        else if( strncmp( "UPDATE", ( const char * ) ( pxPublishInfo->pPayload ), pxPublishInfo->payloadLength ) == 0 )
+    if( xLast )
+    {
+        if( ucCommandLength <= mqttexampleCOMMAND_MAX_LEN )
         {
-            /* Activate sensor task to get a new read */
-            vTaskResume(app_data->sensor_task);
-            ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(5000));
-            prvMQTTPublishToTopics( pxMQTTContext );
+            pxDispatch( pxMQTTContext, cCommand, ucCommandLength );
         }
+
+        ucCommandLength = 0;
+    }
+}
+
+/*-----------------------------------------------------------*/
+
+static char prvTopicKey( const char * pcTopic,
+                         uint16_t usLength )
+{
+    return ( usLength > mqttexampleTOPIC_KEY_INDEX ) ? pcTopic[ mqttexampleTOPIC_KEY_INDEX ] : '\0';
+}
+
+/*-----------------------------------------------------------*/
+
+static bool prvFindSubscription( uint16_t usLength,
+                                 char cKey,
+                                 subscription_t * pxSubscription )
+{
+    ( void ) memcpy_P( pxSubscription,
+                       &xSubscriptions[ mqttexampleSLOT( usLength, cKey, mqttexampleTOPIC_SLOTS ) ],
+                       sizeof( subscription_t ) );
+
+    return ( pxSubscription->ucLength != 0U ) && ( pxSubscription->ucLength == usLength );
+}
+
+/*-----------------------------------------------------------*/
+
+static void prvRxCommand( MQTTContext_t * pxMQTTContext,
+                          const char * pcCommand,
+                          uint8_t ucLength )
+{
+    command_t xCommand;
+
+    if( ucLength == 0U )
+    {
+        return;
     }
+
+    ( void ) memcpy_P( &xCommand,
+                       &xRxCommands[ mqttexampleSLOT( ucLength, pcCommand[ 0 ], mqttexampleCOMMAND_SLOTS ) ],
+                       sizeof( xCommand ) );
+
+    /* Verify the message received matches the command on its slot. */
+    if( ( xCommand.ucLength == ucLength ) && ( strncmp_P( pcCommand, xCommand.pcName, ucLength ) == 0 ) )
+    {
+        xCommand.pxHandler( pxMQTTContext );
+    }
+}
+
+/*-----------------------------------------------------------*/
+
+static void prvCommandOn( MQTTContext_t * pxMQTTContext )
+{
+    ( void ) pxMQTTContext;
+
+    digitalIOSet(mLED_0, pdTRUE);
+}
+
+/*-----------------------------------------------------------*/
+
+static void prvCommandOff( MQTTContext_t * pxMQTTContext )
+{
+    ( void ) pxMQTTContext;
+
+    digitalIOSet(mLED_0, pdFALSE);
+}
+
+/*-----------------------------------------------------------*/
+
+static void prvCommandUpdate( MQTTContext_t * pxMQTTContext )
+{
+    /* ASCII commands have no sequence number. */
+    prvRequestReading( pxMQTTContext, 0U );
+}
+
+/*-----------------------------------------------------------*/
+
+static void prvRequestReading( MQTTContext_t * pxMQTTContext,
+                               uint8_t ucSeq )
+{
+#if HCSR04_SAMPLE_RATE_HZ
+    /* The sensor task samples continuously, publish the latest read. */
+    prvMQTTPublishToTopics( pxMQTTContext, ucSeq );
+#else
+    ( void ) pxMQTTContext;
+
+    /* Activate sensor task to get a new read. It is published when
+     * APP_EVENT_SENSOR_READY comes in, the callback does not wait. A second
+     * request before that only gets the newer sequence number. */
+    ucUpdateSeq = ucSeq;
+    xUpdatePending = true;
+    vTaskResume(app_data->sensor_task);
+#endif
+}
+
+/*-----------------------------------------------------------*/
+
+static void prvRxFrame( MQTTContext_t * pxMQTTContext,
+                        const uint8_t * pucPayload,
+                        size_t xLength )
+{
+    app_frame_t xFrame;
+    opcodeHandler_t pxHandler = NULL;
+    app_status_t xStatus;
+
+    xStatus = appFrameDecode( pucPayload, xLength, &xFrame );
+
+    if( ( xStatus == APP_STATUS_OK ) && ( xFrame.opcode < mqttexampleOPCODE_SLOTS ) )
+    {
+        ( void ) memcpy_P( &pxHandler, &xRxOpcodes[ xFrame.opcode ], sizeof( pxHandler ) );
+    }
+
+    if( pxHandler != NULL )
+    {
+        pxHandler( pxMQTTContext, &xFrame );
+    }
+    else
+    {
+        prvPublishFrame( pxMQTTContext, APP_OP_ACK, xFrame.seq,
+                         ( xStatus == APP_STATUS_OK ) ? APP_STATUS_BAD_OPCODE : xStatus,
+                         xFrame.opcode );
+    }
+}
+
+/*-----------------------------------------------------------*/
+
+static void prvOpOutput( MQTTContext_t * pxMQTTContext,
+                         const app_frame_t * pxFrame )
+{
+    uint8_t ucStatus = APP_STATUS_BAD_ARG;
+
+    /* The debug LEDs and the error LED are not for the host. */
+    if( mqttexampleHOST_OUTPUT( pxFrame->arg ) && ( pxFrame->value <= 1U ) )
+    {
+        digitalIOSet( pxFrame->arg, pxFrame->value ? pdTRUE : pdFALSE );
+        ucStatus = APP_STATUS_OK;
+    }
+
+    prvPublishFrame( pxMQTTContext, APP_OP_ACK, pxFrame->seq, ucStatus, pxFrame->opcode );
+}
+
+/*-----------------------------------------------------------*/
+
+static void prvOpRead( MQTTContext_t * pxMQTTContext,
+                       const app_frame_t * pxFrame )
+{
+    prvRequestReading( pxMQTTContext, pxFrame->seq );
 }
 
 /*-----------------------------------------------------------*/
@@ -803,20 +2140,10 @@ static void prvEventCallback( MQTTContext_t * pxMQTTContext,
 
 static uint32_t prvGetTimeMs( void )
 {
-    TickType_t xTickCount = 0;
-    uint32_t ulTimeMs = 0UL;
-
-    /* Get the current tick count. */
-    xTickCount = xTaskGetTickCount();
-
-    /* Convert the ticks to milliseconds. */
-    ulTimeMs = ( uint32_t ) xTickCount * MILLISECONDS_PER_TICK;
-
-    /* Reduce ulGlobalEntryTimeMs from obtained time so as to always return the
-     * elapsed time in the application. */
-    ulTimeMs = ( uint32_t ) ( ulTimeMs - ulGlobalEntryTimeMs );
-
-    return ulTimeMs;
+    /* Milliseconds since boot from the tick timer, it does not wrap with the
+     * 16 bit tick count. coreMQTT compares times by subtraction, so the wrap
+     * after 49.7 days is harmless too. */
+    return ulPortGetTimeMs();
 }
 
 /*-----------------------------------------------------------*/
@@ -824,26 +2151,15 @@ static uint32_t prvGetTimeMs( void )
 static MQTTStatus_t prvProcessLoopWithTimeout( MQTTContext_t * pMqttContext,
                                                uint32_t ulTimeoutMs )
 {
-    uint32_t ulMqttProcessLoopTimeoutTime;
-    uint32_t ulCurrentTime;
+    uint32_t ulStartTime = pMqttContext->getTime();
 
     MQTTStatus_t eMqttStatus = MQTTSuccess;
 
-    ulCurrentTime = pMqttContext->getTime();
-    if (ulCurrentTime + ulTimeoutMs < ulCurrentTime) //overflow
-        ulMqttProcessLoopTimeoutTime = ulTimeoutMs;
-    else
-        ulMqttProcessLoopTimeoutTime = ulCurrentTime + ulTimeoutMs;
-
     /* Call MQTT_ProcessLoop multiple times a timeout happens, or
-     * MQTT_ProcessLoop fails. */
-    while( ( ulCurrentTime < ulMqttProcessLoopTimeoutTime ) || (eMqttStatus == MQTTNeedMoreBytes) )
+     * MQTT_ProcessLoop fails. The elapsed time is right across a wrap. */
+    while( ( ( pMqttContext->getTime() - ulStartTime ) < ulTimeoutMs ) || ( eMqttStatus == MQTTNeedMoreBytes ) )
     {
         eMqttStatus = MQTT_ProcessLoop( pMqttContext );
-        ulTimeoutMs = pMqttContext->getTime();
-        if (ulCurrentTime >= ulTimeoutMs) //overflow
-            break;
-        ulCurrentTime = ulTimeoutMs;
     }
 
     return eMqttStatus;
@@ -851,24 +2167,337 @@ static MQTTStatus_t prvProcessLoopWithTimeout( MQTTContext_t * pMqttContext,
 
 /*-----------------------------------------------------------*/
 
-static void prvInitializeTopicBuffers( void )
+static MQTTStatus_t prvProcessPendingPackets( MQTTContext_t * pxMQTTContext )
+{
+    MQTTStatus_t eMqttStatus;
+    uint32_t ulStartTime = pxMQTTContext->getTime();
+
+    /* One call per packet, keep going while more bytes are already waiting.
+     * An empty call still takes care of the keep-alive. */
+    do
+    {
+        eMqttStatus = MQTT_ProcessLoop( pxMQTTContext );
+    } while( ( ( eMqttStatus == MQTTNeedMoreBytes ) || ( esp8266AT_Available() > 0 ) ) &&
+             ( ( pxMQTTContext->getTime() - ulStartTime ) < mqttexamplePROCESS_LOOP_TIMEOUT_MS ) );
+
+    return eMqttStatus;
+}
+
+/*-----------------------------------------------------------*/
+
+static int32_t prvStreamingRecv( NetworkContext_t * pxNetworkContext,
+                                 void * pvBuffer,
+                                 size_t xBytesToRecv )
+{
+    uint8_t * pucBuffer = ( uint8_t * ) pvBuffer;
+    MQTTContext_t * pxMQTTContext = pxNetworkContext->pxMQTTContext;
+    int32_t lResult;
+    size_t xCopied = 0;
+    size_t xLength;
+
+    /* At a packet boundary, read the next fixed header first. PUBLISHes too
+     * large for the network buffer are consumed here, look past them. */
+    while( xStream.xHeaderDone == false )
+    {
+        lResult = prvReadFixedHeader();
+
+        if( lResult <= 0 )
+        {
+            return lResult;
+        }
+
+        if( ( ( xStream.ucHeader[ 0 ] & 0xF0U ) == MQTT_PACKET_TYPE_PUBLISH ) &&
+            ( ( xStream.ucHeaderLength + xStream.ulRemaining ) > pxMQTTContext->networkBuffer.size ) )
+        {
+            if( prvStreamPublish( pxMQTTContext ) == false )
+            {
+                return -1;
+            }
+
+            xStream.ucHeaderLength = 0;
+            xStream.xHeaderDone = false;
+        }
+    }
+
+    /* Hand the fixed header over, then the packet up to its last byte so the
+     * next header is seen here. */
+    while( ( xStream.ucHeaderSent < xStream.ucHeaderLength ) && ( xCopied < xBytesToRecv ) )
+    {
+        pucBuffer[ xCopied++ ] = xStream.ucHeader[ xStream.ucHeaderSent++ ];
+    }
+
+    xLength = xBytesToRecv - xCopied;
+
+    if( xLength > xStream.ulRemaining )
+    {
+        xLength = ( size_t ) xStream.ulRemaining;
+    }
+
+    if( xLength > 0U )
+    {
+        lResult = esp8266AT_recv( pxNetworkContext, &pucBuffer[ xCopied ], xLength );
+
+        if( lResult < 0 )
+        {
+            return lResult;
+        }
+
+        xCopied += ( size_t ) lResult;
+        xStream.ulRemaining -= ( uint32_t ) lResult;
+    }
+
+    if( ( xStream.ucHeaderSent == xStream.ucHeaderLength ) && ( xStream.ulRemaining == 0U ) )
+    {
+        xStream.ucHeaderLength = 0;
+        xStream.xHeaderDone = false;
+    }
+
+    return ( int32_t ) xCopied;
+}
+
+/*-----------------------------------------------------------*/
+
+static int32_t prvReadFixedHeader( void )
+{
+    uint8_t ucByte;
+
+    while( xStream.xHeaderDone == false )
+    {
+        if( xStream.ucHeaderLength == 0U )
+        {
+            xStream.ucHeaderSent = 0;
+            xStream.ulRemaining = 0;
+        }
+
+        if( esp8266AT_recv( NULL, &ucByte, 1 ) != 1 )
+        {
+            return 0;
+        }
+
+        xStream.ucHeader[ xStream.ucHeaderLength++ ] = ucByte;
+
+        if( xStream.ucHeaderLength > 1U )
+        {
+            /* Remaining length, 7 bits per byte, least significant first. */
+            xStream.ulRemaining |= ( uint32_t ) ( ucByte & 0x7FU ) << ( 7U * ( xStream.ucHeaderLength - 2U ) );
+
+            if( ( ucByte & 0x80U ) == 0U )
+            {
+                xStream.xHeaderDone = true;
+            }
+            else if( xStream.ucHeaderLength == sizeof( xStream.ucHeader ) )
+            {
+                return -1;
+            }
+        }
+    }
+
+    return 1;
+}
+
+/*-----------------------------------------------------------*/
+
+static bool prvStreamPublish( MQTTContext_t * pxMQTTContext )
 {
-    uint32_t ulTopicCount;
-    int xCharactersWritten;
+    uint8_t ucChunk[ mqttexampleSTREAM_CHUNK_SIZE ];
+    MQTTFixedBuffer_t xAckBuffer = { ucChunk, MQTT_PUBLISH_ACK_PACKET_SIZE };
+    MQTTQoS_t xQoS = ( MQTTQoS_t ) ( ( xStream.ucHeader[ 0 ] >> 1 ) & 0x03U );
+    MQTTPublishState_t xState = MQTTStateNull;
+    MQTTStatus_t xResult;
+    subscription_t xSubscription = { 0 };
+    uint32_t ulRemaining = xStream.ulRemaining;
+    uint16_t usTopicLength, usOffset, usPacketId = 0;
+    size_t xLength;
+    bool xDeliver = false;
+    bool xFirstChunk = true;
+
+    /* Topic name, compared with the subscription as it comes in. */
+    if( ( ulRemaining < 2U ) || !prvRecvExact( pxMQTTContext, ucChunk, 2U ) )
+    {
+        return false;
+    }
 
+    usTopicLength = ( uint16_t ) ( ( ( uint16_t ) ucChunk[ 0 ] << 8 ) | ucChunk[ 1 ] );
+    ulRemaining -= 2U;
 
-    for( ulTopicCount = 0; ulTopicCount < mqttexampleTOPIC_COUNT; ulTopicCount++ )
+    for( usOffset = 0; usOffset < usTopicLength; usOffset += xLength )
     {
-        /* Write topic strings into buffers. */
-        xCharactersWritten = snprintf( xTopicFilterContext[ ulTopicCount ].pcTopicFilter,
-                                       mqttexampleTOPIC_BUFFER_SIZE,
-                                       "%s", mqttexampleRX_TOPIC_NAME);
+        xLength = usTopicLength - usOffset;
 
-        configASSERT( xCharactersWritten >= 0 && xCharactersWritten < mqttexampleTOPIC_BUFFER_SIZE );
+        if( xLength > sizeof( ucChunk ) )
+        {
+            xLength = sizeof( ucChunk );
+        }
 
-        /* Assign topic string to its corresponding SUBACK code initialized as a failure. */
-        xTopicFilterContext[ ulTopicCount ].xSubAckStatus = MQTTSubAckFailure;
+        if( ( ulRemaining < xLength ) || !prvRecvExact( pxMQTTContext, ucChunk, xLength ) )
+        {
+            return false;
+        }
+
+        ulRemaining -= xLength;
+
+        if( usOffset == 0U )
+        {
+            /* The key character is in the first chunk. */
+            xDeliver = prvFindSubscription( usTopicLength,
+                                            prvTopicKey( ( const char * ) ucChunk, ( uint16_t ) xLength ),
+                                            &xSubscription );
+        }
+
+        xDeliver = xDeliver && ( memcmp( &xSubscription.pcTopic[ usOffset ], ucChunk, xLength ) == 0 );
+    }
+
+    if( xQoS != MQTTQoS0 )
+    {
+        if( ( ulRemaining < 2U ) || !prvRecvExact( pxMQTTContext, ucChunk, 2U ) )
+        {
+            return false;
+        }
+
+        usPacketId = ( uint16_t ) ( ( ( uint16_t ) ucChunk[ 0 ] << 8 ) | ucChunk[ 1 ] );
+        ulRemaining -= 2U;
+
+        /* Record it the way coreMQTT would, so the PUBREL of a QoS2 publish
+         * is handled by the library. A duplicate of a QoS2 publish already
+         * received is only acknowledged again. */
+        xResult = MQTT_UpdateStatePublish( pxMQTTContext, usPacketId, MQTT_RECEIVE, xQoS, &xState );
+
+        if( xResult == MQTTStateCollision )
+        {
+            xDeliver = false;
+            xState = ( xQoS == MQTTQoS1 ) ? MQTTPubAckSend : MQTTPubRecSend;
+        }
+        else if( xResult != MQTTSuccess )
+        {
+            return false;
+        }
     }
+
+    /* Payload, in chunks. */
+    ucCommandLength = 0;
+
+    while( ulRemaining > 0U )
+    {
+        xLength = ( ulRemaining > sizeof( ucChunk ) ) ? sizeof( ucChunk ) : ( size_t ) ulRemaining;
+
+        if( !prvRecvExact( pxMQTTContext, ucChunk, xLength ) )
+        {
+            return false;
+        }
+
+        ulRemaining -= xLength;
+
+        if( xDeliver && xFirstChunk && appFrameIsBinary( ucChunk, xLength ) )
+        {
+            /* A frame is never longer than a chunk. A longer payload is
+             * handed over cut to the chunk, that is answered with
+             * APP_STATUS_BAD_LENGTH, and the rest is skipped. */
+            if( xSubscription.pxFrame != NULL )
+            {
+                xSubscription.pxFrame( pxMQTTContext, ucChunk, xLength );
+            }
+
+            xDeliver = false;
+        }
+
+        if( xDeliver )
+        {
+            prvTokenizeCommands( pxMQTTContext, xSubscription.pxDispatch, ucChunk, xLength, ulRemaining == 0U );
+        }
+
+        xFirstChunk = false;
+    }
+
+    if( xQoS == MQTTQoS0 )
+    {
+        return true;
+    }
+
+    /* PUBACK or PUBREC, built in the chunk buffer. */
+    xResult = MQTT_SerializeAck( &xAckBuffer,
+                                 ( xState == MQTTPubAckSend ) ? MQTT_PACKET_TYPE_PUBACK : MQTT_PACKET_TYPE_PUBREC,
+                                 usPacketId );
+
+    if( ( xResult != MQTTSuccess ) ||
+        ( pxMQTTContext->transportInterface.send( pxMQTTContext->transportInterface.pNetworkContext,
+                                                  ucChunk, MQTT_PUBLISH_ACK_PACKET_SIZE ) != ( int32_t ) MQTT_PUBLISH_ACK_PACKET_SIZE ) )
+    {
+        return false;
+    }
+
+    ( void ) MQTT_UpdateStateAck( pxMQTTContext,
+                                  usPacketId,
+                                  ( xState == MQTTPubAckSend ) ? MQTTPuback : MQTTPubrec,
+                                  MQTT_SEND,
+                                  &xState );
+
+    return true;
+}
+
+/*-----------------------------------------------------------*/
+
+static bool prvRecvExact( MQTTContext_t * pxMQTTContext,
+                          uint8_t * pucBuffer,
+                          size_t xLength )
+{
+    uint32_t ulLastRecvTime = pxMQTTContext->getTime();
+    int32_t lResult;
+
+    while( xLength > 0U )
+    {
+        lResult = esp8266AT_recv( NULL, pucBuffer, xLength );
+
+        if( lResult > 0 )
+        {
+            pucBuffer += lResult;
+            xLength -= ( size_t ) lResult;
+            ulLastRecvTime = pxMQTTContext->getTime();
+        }
+        else if( ( lResult < 0 ) ||
+                 ( ( pxMQTTContext->getTime() - ulLastRecvTime ) >= mqttexampleSTREAM_TIMEOUT_MS ) )
+        {
+            return false;
+        }
+    }
+
+    return true;
 }
 
 /*-----------------------------------------------------------*/
+
+static TickType_t prvTicksToKeepAlive( MQTTContext_t * pxMQTTContext )
+{
+    uint32_t ulDeadline;
+    uint32_t ulRemaining;
+
+    if( pxMQTTContext->waitingForPingResp )
+    {
+        ulDeadline = pxMQTTContext->pingReqSendTimeMs + MQTT_PINGRESP_TIMEOUT_MS;
+    }
+    else
+    {
+        ulDeadline = pxMQTTContext->lastPacketTxTime +
+                     ( uint32_t ) pxMQTTContext->keepAliveIntervalSec * MILLISECONDS_PER_SECOND;
+    }
+
+    /* The keep-alive interval is longer than the diagnostics period. */
+    if( ( int32_t ) ( ulDeadline - ( ulDiagLastTimeMs + mqttexampleDIAG_PERIOD_MS ) ) > 0 )
+    {
+        ulDeadline = ulDiagLastTimeMs + mqttexampleDIAG_PERIOD_MS;
+    }
+
+    ulRemaining = ulDeadline - pxMQTTContext->getTime();
+
+    if( ( int32_t ) ulRemaining <= 0 )
+    {
+        return 0;
+    }
+
+    /* coreMQTT acts once the deadline has passed, so wake one tick late. */
+    ulRemaining = ulRemaining / MILLISECONDS_PER_TICK + 1U;
+
+    return ( ulRemaining < portMAX_DELAY ) ? ( TickType_t ) ulRemaining : ( portMAX_DELAY - 1U );
+}
+
+/*-----------------------------------------------------------*/
+
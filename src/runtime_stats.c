@@ -0,0 +1,88 @@
+/*
+ * MIT License
+ * Copyright (c) 2024 Vinicius Silva.  All Rights Reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ */
+
+#include "runtime_stats.h"
+#include "drivers/serial.h"
+
+#define CPU_FULL_SCALE                  200
+
+//Run time counters and time at the previous record, the counters wrap
+//around so only differences are used.
+static uint32_t last_counter[RUNTIME_STATS_MAX_TASKS];
+static uint32_t last_time;
+
+static uint8_t *put16(uint8_t *p, uint16_t v);
+static uint8_t *put32(uint8_t *p, uint32_t v);
+/*-----------------------------------------------------------*/
+
+size_t runtimeStatsRecord(const TaskHandle_t *tasks, unsigned char count, uint8_t *record) {
+
+    uint8_t *p = record;
+    uint32_t now = ulPortGetTimeUs();
+    uint32_t period = now - last_time;
+    //Run time per 0.5%, rounded up so a share never exceeds full scale
+    uint32_t unit = period / CPU_FULL_SCALE + 1;
+    uint32_t counter, share;
+    xSerialStats serial;
+    unsigned char i;
+
+    if (count > RUNTIME_STATS_MAX_TASKS) {
+        count = RUNTIME_STATS_MAX_TASKS;
+    }
+    last_time = now;
+
+    *p++ = RUNTIME_STATS_VERSION;
+    *p++ = count;
+    p = put16(p, period / 1000 > 0xffff ? 0xffff : (uint16_t) (period / 1000));
+
+    for (i = 0; i < count; i++) {
+        counter = ulTaskGetRunTimeCounter(tasks[i]);
+        share = (counter - last_counter[i]) / unit;
+        last_counter[i] = counter;
+
+        *p++ = (uint8_t) pcTaskGetName(tasks[i])[0];
+        *p++ = (uint8_t) share;
+        //StackType_t is a byte on this port
+        p = put16(p, uxTaskGetStackHighWaterMark2(tasks[i]));
+    }
+
+    vSerialGetStats(NULL, &serial);
+    p = put32(p, serial.ulRxBytes);
+    p = put32(p, serial.ulTxBytes);
+    p = put16(p, serial.usRxDropped);
+
+    return (size_t) (p - record);
+}
+/*-----------------------------------------------------------*/
+
+uint8_t *put16(uint8_t *p, uint16_t v) {
+    *p++ = (uint8_t) v;
+    *p++ = (uint8_t) (v >> 8);
+    return p;
+}
+/*-----------------------------------------------------------*/
+
+uint8_t *put32(uint8_t *p, uint32_t v) {
+    p = put16(p, (uint16_t) v);
+    return put16(p, (uint16_t) (v >> 16));
+}
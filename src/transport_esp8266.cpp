@@ -26,6 +26,7 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <avr/pgmspace.h>
 #include "FreeRTOS.h"
 #include "task.h"
 #include "queue.h"
@@ -33,17 +34,32 @@
 #include "drivers/serial.h"
 #include "drivers/digital_io.h"
 
-#define SLEEP                           vTaskDelay(pdMS_TO_TICKS(100))
 #define NO_BLOCK                        0x00
 #define TX_BLOCK                        portMAX_DELAY
 #define RX_BLOCK                        portMAX_DELAY
 
+//Send a string literal kept in flash
+#define SEND_P(s)                       xSerialWrite_P(NULL, PSTR(s), sizeof(s) - 1, TX_BLOCK)
+
 #define mLED                            mLED_8266RX
 
 //constants
 const unsigned long BAUD_RATE =         115200;
 const int BUFFER_LEN =                  48;
-const int AT_REPLY_LEN =                7;
+const int RX_CHUNK_LEN =                16;
+const int LINE_LEN =                    10;
+const TickType_t AT_REPLY_TIMEOUT =     pdBLOCK_MS(1000);
+const TickType_t CONNECT_TIMEOUT =      pdBLOCK_MS(5000);
+const TickType_t DATA_WRITE_TIMEOUT =   pdBLOCK_MS(1000);
+const TickType_t PROMPT_TIMEOUT =       pdBLOCK_MS(500);
+const TickType_t SEND_TIMEOUT =         pdBLOCK_MS(5000);
+const size_t MAX_SEND_LEN =             2048; //per AT+CIPSEND
+const int32_t SEND_FAILURE =            -1;
+const int32_t RECV_FAILURE =            -1;
+const TickType_t PASSTHROUGH_GUARD =    pdBLOCK_MS(1000); //silence around "+++"
+
+//Size of the +IPD payload buffer, must be a power of two up to 128
+#define DATA_BUFFER_LEN                 128
 
 enum transportStatus {
     AT_UNINITIALIZED = 0,
@@ -54,34 +70,136 @@ enum transportStatus {
     ERROR
 };
 
+//Result lines recognised by rxThread, posted to controlQ
+enum atEvent {
+    AT_EVENT_NONE = 0,
+    AT_EVENT_OK,
+    AT_EVENT_ERROR,
+    AT_EVENT_CONNECT,
+    AT_EVENT_CLOSED,
+    AT_EVENT_PROMPT,
+    AT_EVENT_SEND_OK,
+    AT_EVENT_SEND_FAIL
+};
+
+//rxThread parser states
+enum rxState {
+    RX_IDLE = 0,    //at the start of a line
+    RX_HEADER,      //matching "+IPD,"
+    RX_LENGTH,      //payload length digits, up to ':'
+    RX_PAYLOAD,     //payload bytes, go to the data buffer
+    RX_LINE,        //any other line, up to '\n'
+    RX_RAW          //passthrough, everything goes to the data buffer
+};
+
 /* As networking data and control data all comes from same UART interface,
- * COMRx will be responsible to collect them all and populate in two 
- * different queues accordingly, dataQueue and controlQueue. The transport
- * program shall consume data from these buffers.
+ * rxThread will be responsible to collect them all and split them in two
+ * paths: +IPD payloads go to data_buffer, result lines are turned into
+ * atEvent codes on controlQ. The transport program shall consume data
+ * from these buffers.
  */
 static QueueHandle_t controlQ;
-static QueueHandle_t dataQ;
-static char esp8266_status = AT_UNINITIALIZED;
+static StaticQueue_t controlQ_struct;
+static uint8_t controlQ_storage[BUFFER_LEN/3];
+static StaticTask_t rx_task;
+static StackType_t rx_stack[ESP8266_RX_STACK_SIZE];
+static TaskHandle_t rx_handle;
+static volatile char esp8266_status = AT_UNINITIALIZED;
+
+//Single producer (rxThread) / single consumer (esp8266AT_recv) ring
+static char data_buffer[DATA_BUFFER_LEN];
+static volatile unsigned char data_head;
+static volatile unsigned char data_tail;
+static TaskHandle_t data_reader;
+static TaskHandle_t data_writer;
+static TaskHandle_t volatile rx_notify_task;
+static volatile uint32_t rx_notify_bits;
+
+//rxThread parser context
+static char rx_chunk[RX_CHUNK_LEN];
+static char line[LINE_LEN];
+static unsigned char line_len;
+static unsigned char rx_state = RX_IDLE;
+static unsigned char header_index;
+static int32_t data_length;
+//Set by the transport to enter RX_RAW on the next '>', cleared to leave it
+static volatile bool passthrough;
+//Characters of raw_closed matched at the end of the RX_RAW stream
+static unsigned char closed_index;
+
+static const char ipd_header[] PROGMEM = "+IPD,";
+static const char raw_closed[] PROGMEM = "\r\nCLOSED\r\n";
+
+struct atLine {
+    const char *text;
+    char event;
+};
+
+static const char line_ok[] PROGMEM = "OK";
+static const char line_error[] PROGMEM = "ERROR";
+static const char line_fail[] PROGMEM = "FAIL";
+static const char line_connect[] PROGMEM = "CONNECT";
+static const char line_closed[] PROGMEM = "CLOSED";
+static const char line_send_ok[] PROGMEM = "SEND OK";
+static const char line_send_fail[] PROGMEM = "SEND FAIL";
+
+static const atLine at_lines[] PROGMEM = {
+    {line_ok, AT_EVENT_OK},
+    {line_error, AT_EVENT_ERROR},
+    {line_fail, AT_EVENT_ERROR},
+    {line_connect, AT_EVENT_CONNECT},
+    {line_closed, AT_EVENT_CLOSED},
+    {line_send_ok, AT_EVENT_SEND_OK},
+    {line_send_fail, AT_EVENT_SEND_FAIL}
+};
 
 static void rxThread(void *args);
+static size_t rx_idle(const char *c, size_t n);
+static size_t rx_header(const char *c, size_t n);
+static size_t rx_length(const char *c, size_t n);
+static size_t rx_payload(const char *c, size_t n);
+static size_t rx_line(const char *c, size_t n);
+static size_t rx_raw(const char *c, size_t n);
+static void line_done();
+static void data_write(const char *c, size_t n);
+static void data_notify();
+static size_t data_read(char *c, size_t n, TickType_t timeout);
+static void set_waiting(TaskHandle_t *waiting);
+static void clear_waiting(TaskHandle_t *waiting);
+static void wake(TaskHandle_t *waiting);
 static void check_AT();
 static void start_TCP(const char *pHostName, const char *port);
 static void stop_TCP();
-static void send_to_controlQ(int n, const char *c);
+#ifdef ESP8266_PASSTHROUGH
+static void enter_passthrough();
+static void exit_passthrough();
+#else
+static bool cipsend_start(size_t len);
+static bool cipsend_done();
+#endif
+static const TransportOutVector_t *write_vectors(const TransportOutVector_t *vector, size_t *offset, size_t len);
+static char wait_event(TickType_t timeout);
+static void post_event(char event);
+
+//One handler per rxState. Each consumes what it can from the chunk and
+//returns how many bytes it used.
+static size_t (*const rx_handlers[])(const char *c, size_t n) = {
+    rx_idle,
+    rx_header,
+    rx_length,
+    rx_payload,
+    rx_line,
+    rx_raw
+};
 
-BaseType_t esp8266Initialise(configSTACK_DEPTH_TYPE stackSize, void *pvParameters, UBaseType_t priority) {
+void esp8266Initialise(void *pvParameters, UBaseType_t priority) {
 
     xSerialPortInitMinimal(BAUD_RATE, BUFFER_LEN);
-    controlQ = xQueueCreate(BUFFER_LEN/3, (UBaseType_t) sizeof(char));
-    if (!controlQ)
-        return pdFAIL;
-    dataQ = xQueueCreate(BUFFER_LEN, (UBaseType_t) sizeof(char));
-    if (!dataQ)
-        return pdFAIL;
-    if (xTaskCreate(rxThread, "8266", stackSize, pvParameters, priority, NULL) != pdPASS)
-        return pdFAIL;
+    controlQ = xQueueCreateStatic(sizeof(controlQ_storage), (UBaseType_t) sizeof(char),
+                                  controlQ_storage, &controlQ_struct);
+    rx_handle = xTaskCreateStatic(rxThread, "8266", ESP8266_RX_STACK_SIZE, pvParameters, priority,
+                                  rx_stack, &rx_task);
     esp8266_status = RX_THREAD_INITIALIZED;
-    return pdPASS;
 }
 
 esp8266TransportStatus_t esp8266AT_Connect(const char *pHostName, const char *port) {
@@ -90,7 +208,8 @@ esp8266TransportStatus_t esp8266AT_Connect(const char *pHostName, const char *po
         return ESP8266_TRANSPORT_SUCCESS;
     }
 
-    if (esp8266_status != RX_THREAD_INITIALIZED) {
+    //ERROR or AT_READY are left behind by a failed attempt, start over
+    if (esp8266_status < RX_THREAD_INITIALIZED) {
         return ESP8266_TRANSPORT_CONNECT_FAILURE;
     }
 
@@ -104,10 +223,24 @@ esp8266TransportStatus_t esp8266AT_Connect(const char *pHostName, const char *po
         return ESP8266_TRANSPORT_CONNECT_FAILURE;
     }
 
+#ifdef ESP8266_PASSTHROUGH
+    enter_passthrough();
+    if (esp8266_status == ERROR) {
+        stop_TCP();
+        return ESP8266_TRANSPORT_CONNECT_FAILURE;
+    }
+#endif
+
     return ESP8266_TRANSPORT_SUCCESS;
 }
 
 esp8266TransportStatus_t esp8266AT_Disconnect(void) {
+#ifdef ESP8266_PASSTHROUGH
+    //Also after a CLOSED, the ESP8266 stays in passthrough until "+++"
+    if (passthrough) {
+        exit_passthrough();
+    }
+#endif
     if (esp8266_status != CONNECTED) {
         return ESP8266_TRANSPORT_CONNECT_FAILURE;
     }
@@ -115,91 +248,86 @@ esp8266TransportStatus_t esp8266AT_Disconnect(void) {
     return ESP8266_TRANSPORT_SUCCESS;
 }
 
-int32_t esp8266AT_recv(NetworkContext_t *pNetworkContext, void *pBuffer, size_t bytesToRecv) {
-    int32_t bytes_read = 0;
-    char byte;
+void esp8266AT_SetRxNotify(TaskHandle_t task, uint32_t bits) {
+    taskENTER_CRITICAL();
+    rx_notify_task = task;
+    rx_notify_bits = bits;
+    taskEXIT_CRITICAL();
+}
 
-    while(bytes_read < (int32_t) bytesToRecv) {
-        if (xQueueReceive(dataQ, &byte, pdBLOCK_MS(10))) {
-            *((char*) pBuffer + bytes_read) = byte;
-            bytes_read++;
-        }
-        else {
-            break;
-        }
+size_t esp8266AT_Available(void) {
+    return (unsigned char) (data_head - data_tail);
+}
+
+TaskHandle_t esp8266AT_RxTask(void) {
+    return rx_handle;
+}
+
+int32_t esp8266AT_recv(NetworkContext_t *pNetworkContext, void *pBuffer, size_t bytesToRecv) {
+    //Bytes received before the link went down are still handed out
+    if (esp8266_status != CONNECTED && data_head == data_tail) {
+        return RECV_FAILURE;
     }
 
-    return bytes_read;
+    //Keep reading until bytesToRecv or 10 ms after the call, whichever comes first
+    return (int32_t) data_read((char*) pBuffer, bytesToRecv, pdBLOCK_MS(10));
 }
 
 int32_t esp8266AT_send(NetworkContext_t *pNetworkContext, const void *pBuffer, size_t bytesToSend) {
 
+    TransportOutVector_t vector = {pBuffer, bytesToSend};
+
+    return esp8266AT_writev(pNetworkContext, &vector, 1);
+}
+
+int32_t esp8266AT_writev(NetworkContext_t *pNetworkContext, TransportOutVector_t *pIoVec, size_t ioVecCount) {
+
+    const TransportOutVector_t *vector = pIoVec;
+    size_t offset = 0;
+    size_t total = 0;
+
+    if (esp8266_status != CONNECTED) {
+        return SEND_FAILURE;
+    }
+
+    for (size_t i = 0; i < ioVecCount; i++) {
+        total += pIoVec[i].iov_len;
+    }
+
+#ifdef ESP8266_PASSTHROUGH
+    //The ESP8266 forwards whatever it gets over the TCP link
+    write_vectors(vector, &offset, total);
+    return (int32_t) total;
+#else
     //In a single ATSEND command, we can send up to 2048 bytes at a time;
     int32_t bytes_sent = 0;
-    char command[] = "AT+CIPSEND=2048";
-    char c;
+    size_t len;
 
-    while (bytesToSend / 2048) {
-        //Send AT command
-        for(int i = 0; command[i]; i++) {
-            xSerialPutChar(NULL, command[i], TX_BLOCK);
+    while (total) {
+        len = total > MAX_SEND_LEN ? MAX_SEND_LEN : total;
+        if (!cipsend_start(len)) {
+            break;
         }
-        xSerialPutChar(NULL, '\r', TX_BLOCK);
-        xSerialPutChar(NULL, '\n', TX_BLOCK);
-        SLEEP; //so ESP8266 can process the AT COMMAND;
-        //Should check for errors here, but for now, just send the data.
-        for (int i = 0; i < 2048; i++) {
-            while(!xSerialPutChar(NULL, *((signed char*) pBuffer + bytes_sent), TX_BLOCK));
-            bytes_sent++;
-            bytesToSend--;
+        vector = write_vectors(vector, &offset, len);
+        if (!cipsend_done()) {
+            break;
         }
-        //Should check for errors here... but for now, only clear control buffer.
-        while (xQueueReceive(controlQ, &c, pdBLOCK_MS(100)) > 0);
-    }
-
-    snprintf(&command[11], 5, "%u", bytesToSend);
-    //Send AT command
-    for(int i = 0; command[i]; i++) {
-        xSerialPutChar(NULL, command[i], TX_BLOCK);
-    }
-    xSerialPutChar(NULL, '\r', TX_BLOCK);
-    xSerialPutChar(NULL, '\n', TX_BLOCK);
-    SLEEP; //so ESP8266 can process the AT COMMAND;
-    //Should check for errors here, but for now, just send the data.
-    for (; bytesToSend > 0; bytesToSend--) {
-        while(!xSerialPutChar(NULL, *((signed char*) pBuffer + bytes_sent), TX_BLOCK));
-        bytes_sent++;
+        bytes_sent += len;
+        total -= len;
     }
-    //Should check for errors here... but for now, only clear control buffer.
-    while (xQueueReceive(controlQ, &c, pdBLOCK_MS(100)) > 0);
 
-    return bytes_sent;
+    //Report what already went out, the caller retries the rest
+    return bytes_sent ? bytes_sent : SEND_FAILURE;
+#endif
 }
 
 void check_AT(void) {
 
-    char at_cmd_response[AT_REPLY_LEN] = {0};
-
-    //Send AT command
-    xSerialPutChar(NULL, 'A', TX_BLOCK);
-    xSerialPutChar(NULL, 'T', TX_BLOCK);
-    xSerialPutChar(NULL, 'E', TX_BLOCK); //
-    xSerialPutChar(NULL, '0', TX_BLOCK); // Disable echo
-    xSerialPutChar(NULL, '\r', TX_BLOCK);
-
-    //Clear control buffer, if anything is there
-    while (xQueueReceive(controlQ, at_cmd_response, pdBLOCK_MS(100)) > 0);
+    //Send AT command, with echo disabled. Echoed lines are ignored by rxThread.
+    xQueueReset(controlQ);
+    SEND_P("ATE0\r\n");
 
-    //Complete the command
-    xSerialPutChar(NULL, '\n', TX_BLOCK);
-
-    for (int i = 0; i < AT_REPLY_LEN - 1;) {
-        if (xQueueReceive(controlQ, &at_cmd_response[i], RX_BLOCK) > 0) {
-            i++;
-        }
-    }
-
-    if(strcmp(at_cmd_response, "\r\nOK\r\n")) {
+    if (wait_event(AT_REPLY_TIMEOUT) != AT_EVENT_OK) {
         esp8266_status = ERROR;
     }
     else {
@@ -210,146 +338,434 @@ void check_AT(void) {
 
 void start_TCP(const char *pHostName, const char *port) {
 
-    char c;
+    char event;
 
     //Close existing TCP connection, if any
     stop_TCP();
 
     //AT header to start TCP connection
-    xSerialPutChar(NULL, 'A', TX_BLOCK);
-    xSerialPutChar(NULL, 'T', TX_BLOCK);
-    xSerialPutChar(NULL, '+', TX_BLOCK);
-    xSerialPutChar(NULL, 'C', TX_BLOCK);
-    xSerialPutChar(NULL, 'I', TX_BLOCK);
-    xSerialPutChar(NULL, 'P', TX_BLOCK);
-    xSerialPutChar(NULL, 'S', TX_BLOCK);
-    xSerialPutChar(NULL, 'T', TX_BLOCK);
-    xSerialPutChar(NULL, 'A', TX_BLOCK);
-    xSerialPutChar(NULL, 'R', TX_BLOCK);
-    xSerialPutChar(NULL, 'T', TX_BLOCK);
-    xSerialPutChar(NULL, '=', TX_BLOCK);
-    xSerialPutChar(NULL, '"', TX_BLOCK);
-    xSerialPutChar(NULL, 'T', TX_BLOCK);
-    xSerialPutChar(NULL, 'C', TX_BLOCK);
-    xSerialPutChar(NULL, 'P', TX_BLOCK);
-    xSerialPutChar(NULL, '"', TX_BLOCK);
-    xSerialPutChar(NULL, ',', TX_BLOCK);
-    xSerialPutChar(NULL, '"', TX_BLOCK);
+    xQueueReset(controlQ);
+    SEND_P("AT+CIPSTART=\"TCP\",\"");
 
     //Target IP
-    for (int i = 0; *(pHostName + i); i++) {
-        xSerialPutChar(NULL, *(pHostName + i), TX_BLOCK);
-    }
+    xSerialWrite(NULL, pHostName, strlen(pHostName), TX_BLOCK);
 
-    xSerialPutChar(NULL, '"', TX_BLOCK);
-    xSerialPutChar(NULL, ',', TX_BLOCK);
+    SEND_P("\",");
 
     //Target TCP Port
-    for (int i = 0; *(port + i); i++) {
-        xSerialPutChar(NULL, *(port + i), TX_BLOCK);
-    }
-    xSerialPutChar(NULL, '\r', TX_BLOCK);
-    xSerialPutChar(NULL, '\n', TX_BLOCK);
+    xSerialWrite(NULL, port, strlen(port), TX_BLOCK);
+    SEND_P("\r\n");
 
-    xQueueReceive(controlQ, &c, pdBLOCK_MS(100)); //C, if success
+    //CONNECT, if success. Trailing OK is flushed by the next command.
+    do {
+        event = wait_event(CONNECT_TIMEOUT);
+    } while (event == AT_EVENT_OK);
 
-    if (c != 'C') {
+    if (event != AT_EVENT_CONNECT) {
         esp8266_status = ERROR;
     }
     else {
+      //Drop anything left over from a previous connection
+      data_tail = data_head;
       esp8266_status = CONNECTED;
     }
-    //Clear rx control buffer
-    while (xQueueReceive(controlQ, &c, NO_BLOCK) > 0);
 }
 
 void stop_TCP() {
 
-    char c;
+    char event;
+
     //Close existing TCP connection, if any
-    xSerialPutChar(NULL, 'A', TX_BLOCK);
-    xSerialPutChar(NULL, 'T', TX_BLOCK);
-    xSerialPutChar(NULL, '+', TX_BLOCK);
-    xSerialPutChar(NULL, 'C', TX_BLOCK);
-    xSerialPutChar(NULL, 'I', TX_BLOCK);
-    xSerialPutChar(NULL, 'P', TX_BLOCK);
-    xSerialPutChar(NULL, 'C', TX_BLOCK);
-    xSerialPutChar(NULL, 'L', TX_BLOCK);
-    xSerialPutChar(NULL, 'O', TX_BLOCK);
-    xSerialPutChar(NULL, 'S', TX_BLOCK);
-    xSerialPutChar(NULL, 'E', TX_BLOCK);
-    xSerialPutChar(NULL, '\r', TX_BLOCK);
-    xSerialPutChar(NULL, '\n', TX_BLOCK);
-    //Clear rx control buffer
-    while (xQueueReceive(controlQ, &c, pdBLOCK_MS(100)) > 0);
+    xQueueReset(controlQ);
+    SEND_P("AT+CIPCLOSE\r\n");
+    //Wait for the result, ERROR if there was no connection
+    do {
+        event = wait_event(pdBLOCK_MS(100));
+    } while (event == AT_EVENT_CLOSED);
     esp8266_status = RX_THREAD_INITIALIZED;
 }
 
+#ifdef ESP8266_PASSTHROUGH
+void enter_passthrough() {
+
+    char event;
+
+    xQueueReset(controlQ);
+    SEND_P("AT+CIPMODE=1\r\n");
+    if (wait_event(AT_REPLY_TIMEOUT) != AT_EVENT_OK) {
+        esp8266_status = ERROR;
+        return;
+    }
+
+    //rxThread switches to RX_RAW on the '>' prompt, so no byte is lost
+    closed_index = 0;
+    passthrough = true;
+    SEND_P("AT+CIPSEND\r\n");
+    do {
+        event = wait_event(PROMPT_TIMEOUT);
+    } while (event == AT_EVENT_OK);
+
+    if (event != AT_EVENT_PROMPT) {
+        passthrough = false;
+        esp8266_status = ERROR;
+    }
+}
+
+void exit_passthrough() {
+
+    //"+++" is only taken as the escape sequence when sent on its own
+    vTaskDelay(PASSTHROUGH_GUARD);
+    SEND_P("+++");
+    vTaskDelay(PASSTHROUGH_GUARD);
+
+    //The ESP8266 is back in command mode, let rxThread parse lines again
+    passthrough = false;
+    xQueueReset(controlQ);
+    SEND_P("AT+CIPMODE=0\r\n");
+    wait_event(AT_REPLY_TIMEOUT);
+}
+#else
+bool cipsend_start(size_t len) {
+
+    char length[5];
+    char event;
+
+    xQueueReset(controlQ);
+    SEND_P("AT+CIPSEND=");
+    snprintf(length, sizeof(length), "%u", (unsigned) len);
+    xSerialWrite(NULL, length, strlen(length), TX_BLOCK);
+    SEND_P("\r\n");
+
+    //"OK" comes first, then the '>' prompt when the ESP8266 is ready for data
+    do {
+        event = wait_event(PROMPT_TIMEOUT);
+    } while (event == AT_EVENT_OK);
+
+    return event == AT_EVENT_PROMPT;
+}
+
+bool cipsend_done() {
+
+    char event;
+
+    //"Recv n bytes" is ignored by rxThread, wait for the result line
+    do {
+        event = wait_event(SEND_TIMEOUT);
+    } while (event == AT_EVENT_OK);
+
+    if (event == AT_EVENT_CLOSED) {
+        esp8266_status = RX_THREAD_INITIALIZED;
+    }
+    return event == AT_EVENT_SEND_OK;
+}
+#endif
+
+const TransportOutVector_t *write_vectors(const TransportOutVector_t *vector, size_t *offset, size_t len) {
+
+    //Streams len bytes from the vectors, starting *offset into the first one.
+    //Returns the vector to continue from, with *offset updated.
+    size_t n;
+
+    while (len) {
+        n = vector->iov_len - *offset;
+        if (n > len) {
+            n = len;
+        }
+        xSerialWrite(NULL, (const char*) vector->iov_base + *offset, n, TX_BLOCK);
+        len -= n;
+        *offset += n;
+        if (*offset == vector->iov_len) {
+            *offset = 0;
+            vector++;
+        }
+    }
+    return vector;
+}
+
+char wait_event(TickType_t timeout) {
+    char event;
+
+    if (xQueueReceive(controlQ, &event, timeout) > 0) {
+        return event;
+    }
+    return AT_EVENT_NONE;
+}
+
 void rxThread(void *args) {
 
-    char c[10]; //convert up to 9 decimal digits to int32_t;
-    int32_t data_lenght; //in bytes.... that can count a lot of data....
-    unsigned char index;
+    size_t n, used;
 
-    //Very ugly code, but it works...
     //Keep running forever!!! Tasks cannot return!!!
     for(;;) {
 
 #ifdef  DEBUG_LED
         digitalIOToggle(mLED);
 #endif
-        if (xSerialGetChar(NULL, (signed char*) &c[0], RX_BLOCK)) {
-            if (c[0] == '+') {
-                while(!xSerialGetChar(NULL, (signed char*) &c[1], RX_BLOCK));
-                if (c[1] == 'I') {
-                    while(!xSerialGetChar(NULL, (signed char*) &c[2], RX_BLOCK));
-                    if (c[2] == 'P') {
-                        while(!xSerialGetChar(NULL, (signed char*) &c[3], RX_BLOCK));
-                        if (c[3] == 'D') {
-                            while(!xSerialGetChar(NULL, (signed char*) &c[4], RX_BLOCK));
-                            if (c[4] == ',') { //Hit Magic header!! We got data!!
-                                c[9] = 0;
-                                index = 0;
-                                while(index < 9) {
-                                    while(!xSerialGetChar(NULL, (signed char*) &c[9], RX_BLOCK));
-                                    if (c[9] == ':') {
-                                        c[++index] = 0;
-                                        break;
-                                    }
-                                    c[index++] = c[9];
-                                }
-                                data_lenght = atoi(c);
-                                for (; data_lenght > 0; data_lenght--) {
-                                    while(!xSerialGetChar(NULL, (signed char*) c, RX_BLOCK));
-                                    xQueueSend(dataQ, c, TX_BLOCK);
-                                }
-                            }
-                            else {
-                                send_to_controlQ(5, c);
-                            }
-                        }
-                        else {
-                            send_to_controlQ(4, c);
-                        }
-                    }
-                    else {
-                        send_to_controlQ(3, c);
-                    }
-                }
-                else {
-                    send_to_controlQ(2, c);
-                }
+        //Block for the first byte, then take whatever else is already there
+        n = xSerialRead(NULL, rx_chunk, 1, RX_BLOCK);
+        if (!n) {
+            continue;
+        }
+        n += xSerialRead(NULL, rx_chunk + 1, RX_CHUNK_LEN - 1, NO_BLOCK);
+
+        for (used = 0; used < n;) {
+            used += rx_handlers[rx_state](rx_chunk + used, n - used);
+        }
+    }
+}
+
+size_t rx_idle(const char *c, size_t n) {
+    if (*c == '\r' || *c == '\n') {
+        return 1;
+    }
+    if (*c == '>') { //AT+CIPSEND prompt, not followed by a new line
+        if (passthrough) {
+            rx_state = RX_RAW;
+        }
+        post_event(AT_EVENT_PROMPT);
+        return 1;
+    }
+    line_len = 0;
+    if (*c == '+') {
+        header_index = 0;
+        rx_state = RX_HEADER;
+    }
+    else {
+        rx_state = RX_LINE;
+    }
+    return 0;
+}
+
+size_t rx_header(const char *c, size_t n) {
+    if (*c != (char) pgm_read_byte(&ipd_header[header_index])) {
+        //Not a +IPD, handle it as a regular line. The prefix matched so far
+        //is the same as ipd_header.
+        memcpy_P(line, ipd_header, header_index);
+        line_len = header_index;
+        rx_state = RX_LINE;
+        return 0;
+    }
+    if (++header_index == sizeof(ipd_header) - 1) { //Hit Magic header!! We got data!!
+        data_length = 0;
+        rx_state = RX_LENGTH;
+    }
+    return 1;
+}
+
+size_t rx_length(const char *c, size_t n) {
+    if (*c >= '0' && *c <= '9') {
+        data_length = data_length * 10 + (*c - '0');
+    }
+    else if (*c == ':') {
+        rx_state = data_length > 0 ? RX_PAYLOAD : RX_IDLE;
+    }
+    else {
+        //Malformed header, drop the rest of the line
+        line_len = 0;
+        rx_state = RX_LINE;
+    }
+    return 1;
+}
+
+size_t rx_payload(const char *c, size_t n) {
+    if ((int32_t) n > data_length) {
+        n = (size_t) data_length;
+    }
+    data_write(c, n);
+    data_length -= n;
+    if (!data_length) {
+        data_notify();
+        rx_state = RX_IDLE;
+    }
+    return n;
+}
+
+size_t rx_line(const char *c, size_t n) {
+    size_t i;
+
+    for (i = 0; i < n; i++) {
+        if (c[i] == '\n') {
+            line_done();
+            rx_state = RX_IDLE;
+            return i + 1;
+        }
+        if (line_len < LINE_LEN) {
+            line[line_len] = c[i];
+        }
+        if (line_len < 0xff) {
+            line_len++;
+        }
+    }
+    return n;
+}
+
+size_t rx_raw(const char *c, size_t n) {
+    size_t i;
+
+    if (!passthrough) {
+        rx_state = RX_IDLE;
+        return 0;
+    }
+    data_write(c, n);
+
+    //A lost link shows up as a CLOSED line in the stream, then the ESP8266
+    //goes quiet. Only a match at the end of what was read counts, the same
+    //bytes inside MQTT data are followed by more. The bytes are in the ring
+    //already, the failing recv ends the session anyway.
+    for (i = 0; i < n; i++) {
+        if (c[i] == (char) pgm_read_byte(&raw_closed[closed_index])) {
+            closed_index++;
+        }
+        else {
+            closed_index = (c[i] == '\r') ? 1 : 0;
+        }
+        if (closed_index == sizeof(raw_closed) - 1) {
+            closed_index = 0;
+            if (i == n - 1) {
+                post_event(AT_EVENT_CLOSED);
+                return n;
             }
-            else {
-                xQueueSend(controlQ, c, TX_BLOCK);
+        }
+    }
+
+    data_notify();
+    return n;
+}
+
+void line_done() {
+    unsigned char len = line_len;
+    const char *text;
+
+    //Drop the '\r' in front of '\n'. Lines longer than LINE_LEN match nothing.
+    if (len && len <= LINE_LEN && line[len - 1] == '\r') {
+        len--;
+    }
+
+    for (unsigned char i = 0; i < sizeof(at_lines) / sizeof(at_lines[0]); i++) {
+        text = (const char*) pgm_read_ptr(&at_lines[i].text);
+        if (strlen_P(text) == len && !strncmp_P(line, text, len)) {
+            post_event((char) pgm_read_byte(&at_lines[i].event));
+            return;
+        }
+    }
+}
+
+void post_event(char event) {
+    //Unsolicited CLOSED: the peer or the AP dropped the link. Fail send and
+    //recv from now on and wake the MQTT client, so it notices and reconnects
+    //right away instead of at the keep-alive deadline.
+    if (event == AT_EVENT_CLOSED) {
+        esp8266_status = RX_THREAD_INITIALIZED;
+        data_notify();
+    }
+
+    //Never block the data path on a control reader that is not there
+    xQueueSend(controlQ, &event, NO_BLOCK);
+}
+
+void data_write(const char *c, size_t n) {
+    TimeOut_t time_out;
+    TickType_t block = DATA_WRITE_TIMEOUT;
+    unsigned char head, space;
+
+    vTaskSetTimeOutState(&time_out);
+
+    while (n) {
+        space = DATA_BUFFER_LEN - (unsigned char) (data_head - data_tail);
+        if (!space) {
+            //Full, give esp8266AT_recv some time to make room. If nobody
+            //reads, drop the rest so result lines still get through.
+            //The serial ISRs notify the same index, so a wake up is not
+            //room and only the deadline ends the wait.
+            if (xTaskCheckForTimeOut(&time_out, &block)) {
+                break;
+            }
+            set_waiting(&data_writer);
+            if (data_head == (unsigned char) (data_tail + DATA_BUFFER_LEN)) {
+                ulTaskNotifyTakeIndexed(serNOTIFY_INDEX, pdTRUE, block);
             }
+            clear_waiting(&data_writer);
+            continue;
         }
+        head = data_head;
+        for (; space && n; space--, n--) {
+            data_buffer[head++ & (DATA_BUFFER_LEN - 1)] = *c++;
+        }
+        data_head = head;
     }
+
+    wake(&data_reader);
 }
 
-void send_to_controlQ(int n, const char *c) {
-    for(int i = 0; i < n; i++) {
-        xQueueSend(controlQ, c + i, TX_BLOCK);
+void data_notify() {
+    TaskHandle_t task;
+    uint32_t bits;
+
+    taskENTER_CRITICAL();
+    task = rx_notify_task;
+    bits = rx_notify_bits;
+    taskEXIT_CRITICAL();
+
+    if (task) {
+        xTaskNotify(task, bits, eSetBits);
+    }
+}
+
+size_t data_read(char *c, size_t n, TickType_t timeout) {
+    TimeOut_t time_out;
+    size_t bytes_read = 0;
+    unsigned char tail, count;
+
+    vTaskSetTimeOutState(&time_out);
+
+    while (bytes_read < n) {
+        count = (unsigned char) (data_head - data_tail);
+        if (!count) {
+            //Same as data_write, wait on until the data or the deadline
+            if (xTaskCheckForTimeOut(&time_out, &timeout)) {
+                break;
+            }
+            set_waiting(&data_reader);
+            if (data_head == data_tail) {
+                ulTaskNotifyTakeIndexed(serNOTIFY_INDEX, pdTRUE, timeout);
+            }
+            clear_waiting(&data_reader);
+            continue;
+        }
+        tail = data_tail;
+        for (; count && bytes_read < n; count--) {
+            c[bytes_read++] = data_buffer[tail++ & (DATA_BUFFER_LEN - 1)];
+        }
+        data_tail = tail;
+
+        wake(&data_writer);
+    }
+
+    return bytes_read;
+}
+
+void set_waiting(TaskHandle_t *waiting) {
+    taskENTER_CRITICAL();
+    *waiting = xTaskGetCurrentTaskHandle();
+    taskEXIT_CRITICAL();
+}
+
+void clear_waiting(TaskHandle_t *waiting) {
+    taskENTER_CRITICAL();
+    *waiting = NULL;
+    taskEXIT_CRITICAL();
+}
+
+void wake(TaskHandle_t *waiting) {
+    TaskHandle_t task;
+
+    taskENTER_CRITICAL();
+    task = *waiting;
+    *waiting = NULL;
+    taskEXIT_CRITICAL();
+
+    //A stale notification only makes the waiter check the ring once more
+    if (task) {
+        xTaskNotifyGiveIndexed(task, serNOTIFY_INDEX);
     }
-    return;
 }
@@ -0,0 +1,162 @@
+#!/usr/bin/env python3
+#
+# Copyright (C) 2024 Vinicius Silva. All Rights Reserved.
+#
+# Permission is hereby granted, free of charge, to any person obtaining a copy of
+# this software and associated documentation files (the "Software"), to deal in
+# the Software without restriction, including without limitation the rights to
+# use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+# the Software, and to permit persons to whom the Software is furnished to do so,
+# subject to the following conditions:
+#
+# The above copyright notice and this permission notice shall be included in all
+# copies or substantial portions of the Software.
+#
+# THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+# IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+# FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+# COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+# IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+# CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+#
+
+"""Host side of the binary frames of include/app_protocol.h.
+
+    $ tools/app_protocol.py encode output 3 1 --seq 7
+    81 01 07 03 01 00
+    $ tools/app_protocol.py decode 81 81 07 00 6e 05
+    reading seq=7 status=ok value=1390
+
+The encoded bytes are the payload to publish on /home/garage/control, e.g.
+with mosquitto_pub -s fed from encode --raw.
+
+diag decodes the run time statistics records of include/runtime_stats.h,
+published on /home/garage/diag.
+"""
+
+import argparse
+import struct
+import sys
+
+PROTOCOL_VERSION = 1
+FRAME_MARK = 0x80
+FRAME_SIZE = 6
+
+OPCODES = {
+    'output': 0x01,
+    'read': 0x02,
+    'reading': 0x81,
+    'ack': 0x82,
+}
+
+STATUS = ['ok', 'bad_version', 'bad_length', 'bad_opcode', 'bad_arg', 'no_data']
+
+_FRAME = struct.Struct('<BBBBH')
+
+STATS_VERSION = 1
+_STATS_HEADER = struct.Struct('<BBH')
+_STATS_TASK = struct.Struct('<cBH')
+_STATS_SERIAL = struct.Struct('<IIH')
+
+
+class FrameError(ValueError):
+    pass
+
+
+def encode(opcode, seq=0, arg=0, value=0):
+    """Raises ValueError for an arg or value the frame cannot hold."""
+    if not 0 <= arg <= 0xff:
+        raise ValueError('arg %d out of range 0..255' % arg)
+    if not 0 <= value <= 0xffff:
+        raise ValueError('value %d out of range 0..65535' % value)
+    return _FRAME.pack(FRAME_MARK | PROTOCOL_VERSION, opcode, seq & 0xff, arg, value)
+
+
+def decode(payload):
+    """Returns (opcode, seq, arg, value), raises FrameError like appFrameDecode."""
+    if not payload or payload[0] != FRAME_MARK | PROTOCOL_VERSION:
+        raise FrameError('bad_version')
+    if len(payload) != FRAME_SIZE:
+        raise FrameError('bad_length')
+    return _FRAME.unpack(payload)[1:]
+
+
+def describe(payload):
+    opcode, seq, arg, value = decode(payload)
+    name = next((n for n, o in OPCODES.items() if o == opcode), '0x%02x' % opcode)
+    if opcode in (OPCODES['reading'], OPCODES['ack']):
+        status = STATUS[arg] if arg < len(STATUS) else str(arg)
+        if opcode == OPCODES['ack']:
+            value = next((n for n, o in OPCODES.items() if o == value), value)
+        return '%s seq=%d status=%s value=%s' % (name, seq, status, value)
+    return '%s seq=%d arg=%d value=%d' % (name, seq, arg, value)
+
+
+def decode_stats(payload):
+    """Returns (period_ms, [(name, cpu_percent, stack_free)], (rx, tx, rx_dropped))."""
+    try:
+        version, count, period = _STATS_HEADER.unpack_from(payload)
+        if version != STATS_VERSION:
+            raise FrameError('bad_version')
+        tasks = []
+        offset = _STATS_HEADER.size
+        for _ in range(count):
+            name, cpu, stack = _STATS_TASK.unpack_from(payload, offset)
+            offset += _STATS_TASK.size
+            tasks.append((name.decode('latin-1'), cpu / 2, stack))
+        serial = _STATS_SERIAL.unpack_from(payload, offset)
+    except struct.error:
+        raise FrameError('bad_length')
+    return period, tasks, serial
+
+
+def describe_stats(payload):
+    period, tasks, serial = decode_stats(payload)
+    lines = ['period=%dms' % period]
+    for task in tasks:
+        lines.append('task %s cpu=%.1f%% stack_free=%d' % task)
+    lines.append('serial rx=%d tx=%d rx_dropped=%d' % serial)
+    return '\n'.join(lines)
+
+
+def main(argv):
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    sub = parser.add_subparsers(dest='cmd', required=True)
+
+    enc = sub.add_parser('encode', help='build a frame')
+    enc.add_argument('opcode', choices=OPCODES)
+    enc.add_argument('arg', nargs='?', type=int, default=0)
+    enc.add_argument('value', nargs='?', type=int, default=0)
+    enc.add_argument('--seq', type=int, default=0)
+    enc.add_argument('--raw', action='store_true', help='write the bytes to stdout')
+
+    dec = sub.add_parser('decode', help='print a frame given as hex bytes')
+    dec.add_argument('hex', nargs='+')
+
+    diag = sub.add_parser('diag', help='print a statistics record given as hex bytes')
+    diag.add_argument('hex', nargs='+')
+
+    args = parser.parse_args(argv)
+
+    if args.cmd == 'encode':
+        try:
+            frame = encode(OPCODES[args.opcode], args.seq, args.arg, args.value)
+        except ValueError as e:
+            parser.error(str(e))
+        if args.raw:
+            sys.stdout.buffer.write(frame)
+        else:
+            print(frame.hex(' '))
+        return 0
+
+    try:
+        payload = bytes.fromhex(''.join(args.hex))
+        print(describe_stats(payload) if args.cmd == 'diag' else describe(payload))
+    except FrameError as e:
+        print(e, file=sys.stderr)
+        return 1
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main(sys.argv[1:]))
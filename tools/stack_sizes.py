@@ -0,0 +1,266 @@
+#!/usr/bin/env python3
+#
+# Copyright (C) 2024 Vinicius Silva. All Rights Reserved.
+#
+# Permission is hereby granted, free of charge, to any person obtaining a copy of
+# this software and associated documentation files (the "Software"), to deal in
+# the Software without restriction, including without limitation the rights to
+# use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+# the Software, and to permit persons to whom the Software is furnished to do so,
+# subject to the following conditions:
+#
+# The above copyright notice and this permission notice shall be included in all
+# copies or substantial portions of the Software.
+#
+# THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+# IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+# FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+# COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+# IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+# CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+#
+
+
+"""Stack sizes from measured high-water marks, writes include/stack_sizes.h.
+
+Flash a profiling build (make STACK_PROFILE=1), then with the node online:
+
+    $ tools/stack_sizes.py measure 192.168.0.235 -o marks.json
+    $ tools/stack_sizes.py generate marks.json
+
+measure runs the workload against the node through the broker: wait for it
+to come online, N UPDATE commands and READ frames, a forced reconnect (a
+client connecting with the node's client identifier makes the broker drop
+it), N more updates. The lowest free stack seen in the records published on
+/home/garage/diag is what each task never used.
+
+generate sizes each stack as used + margin and writes the header, keeping
+the profiling sizes for the next round. The margin is the interrupt frame
+worked out below, with the kernel part taken from the -fstack-usage files
+of the profiling build. See doc/stack_sizing.txt.
+"""
+
+import argparse
+import glob
+import json
+import os
+import queue
+import sys
+import time
+
+from app_protocol import OPCODES, FrameError, decode_stats, encode
+
+CLIENT_ID = 'UNO_R3'
+CONTROL_TOPIC = '/home/garage/control'
+DIAG_TOPIC = '/home/garage/diag'
+
+ROOT = os.path.join(os.path.dirname(__file__), '..')
+HEADER = os.path.join(ROOT, 'include', 'stack_sizes.h')
+
+# Where make STACK_PROFILE=1 leaves the .su files, next to the objects.
+SU_DIRS = [ROOT, os.path.join(ROOT, '..', 'Source')]
+
+# Task order of the diagnostics record: (macro suffix, first character of
+# the task name).
+TASKS = [('MQTT', 'M'), ('HCSR04', 'H'), ('8266', '8'), ('IDLE', 'I')]
+
+# Sizes of the profiling build, room to spare so a mark of 0 never happens.
+PROFILE_SIZES = {'MQTT': 440, 'HCSR04': 128, '8266': 128, 'IDLE': 112}
+
+# An interrupt runs on the stack of the task it preempts. The workload only
+# catches one at the deepest point by chance, so the margin covers the worst
+# interrupt that switches tasks, on top of the deepest call of the task:
+#
+#   2   return address pushed by the interrupt
+#   n   prologue of the ISR, the largest __vector_* frame (a signal ISR
+#       that calls out saves r0, r1, SREG, r18-r27, r30, r31: 15 at least)
+#   2   call to vPortYield()
+#   33  task context, r0-r31 and SREG (naked, not in the .su files)
+#   k   vTaskSwitchContext() and what it calls with run time stats on,
+#       ulPortGetTimeUs(): frame + 2 bytes return address each
+#
+# Without .su files n and k fall back to the guesses below.
+ISR_RETURN = 2
+YIELD_CALL = 2
+CONTEXT = 33
+ISR_PROLOGUE_MIN = 15
+KERNEL_CHAIN = ['vTaskSwitchContext', 'ulPortGetTimeUs', 'prvClockRead']
+KERNEL_DEPTH_GUESS = 24
+
+
+def read_stack_usage(paths):
+    """Returns {function: static frame bytes} from gcc -fstack-usage files."""
+    frames = {}
+    for path in paths:
+        if os.path.isdir(path):
+            files = glob.glob(os.path.join(path, '**', '*.su'), recursive=True)
+        else:
+            files = [path] if os.path.isfile(path) else []
+        for name in files:
+            with open(name) as f:
+                for line in f:
+                    fields = line.split('\t')
+                    if len(fields) < 2:
+                        continue
+                    function = fields[0].rsplit(':', 1)[-1]
+                    frames[function] = max(int(fields[1]), frames.get(function, 0))
+    return frames
+
+
+def interrupt_margin(frames):
+    """Returns (margin, lines explaining it)."""
+    vectors = [size for function, size in frames.items() if function.startswith('__vector_')]
+    prologue = max(vectors + [ISR_PROLOGUE_MIN])
+    chain = [(function, frames[function]) for function in KERNEL_CHAIN if function in frames]
+    if chain:
+        kernel = sum(size + 2 for _, size in chain)
+        how = ' + '.join('%s %d+2' % c for c in chain)
+    else:
+        kernel = KERNEL_DEPTH_GUESS
+        how = 'no .su files, guessed'
+    margin = ISR_RETURN + prologue + YIELD_CALL + CONTEXT + kernel
+    return margin, [
+        '%3d  return address of the interrupt' % ISR_RETURN,
+        '%3d  ISR prologue' % prologue,
+        '%3d  call to vPortYield()' % YIELD_CALL,
+        '%3d  task context' % CONTEXT,
+        '%3d  kernel (%s)' % (kernel, how),
+    ]
+
+
+def _client(broker, port, client_id=''):
+    import paho.mqtt.client as mqtt
+    try:
+        client = mqtt.Client(mqtt.CallbackAPIVersion.VERSION2, client_id=client_id)
+    except AttributeError:
+        client = mqtt.Client(client_id=client_id)
+    client.connect(broker, port)
+    return client
+
+
+def measure(broker, port, updates, timeout):
+    records = queue.Queue()
+    lowest = {}
+
+    def on_message(client, userdata, msg):
+        records.put(msg.payload)
+
+    def wait_record():
+        try:
+            payload = records.get(timeout=timeout)
+        except queue.Empty:
+            raise SystemExit('no record on %s within %ds' % (DIAG_TOPIC, timeout))
+        try:
+            _, tasks, _ = decode_stats(payload)
+        except FrameError as e:
+            raise SystemExit('bad record: %s' % e)
+        for (suffix, letter), (name, _, free) in zip(TASKS, tasks):
+            if name != letter:
+                raise SystemExit('task %s in the record, expected %s' % (name, letter))
+            lowest[suffix] = min(free, lowest.get(suffix, free))
+
+    def run_updates():
+        for seq in range(updates):
+            client.publish(CONTROL_TOPIC, 'UPDATE', qos=2)
+            client.publish(CONTROL_TOPIC, encode(OPCODES['read'], seq), qos=2)
+            time.sleep(0.5)
+
+    client = _client(broker, port)
+    client.on_message = on_message
+    client.subscribe(DIAG_TOPIC)
+    client.loop_start()
+
+    print('waiting for the node', file=sys.stderr)
+    wait_record()
+    run_updates()
+    wait_record()
+
+    print('forcing a reconnect', file=sys.stderr)
+    takeover = _client(broker, port, CLIENT_ID)
+    takeover.disconnect()
+    while not records.empty():
+        records.get()
+    wait_record()
+    run_updates()
+    wait_record()
+
+    client.loop_stop()
+    client.disconnect()
+    return lowest
+
+
+def generate(marks, margin, why):
+    lines = [
+        '/* Generated by tools/stack_sizes.py, do not edit. See doc/stack_sizing.txt.',
+        ' *',
+        ' * Task stacks in bytes: measured use (profiling size - high-water mark) +',
+        ' * %d bytes margin for an interrupt switching tasks on top of the deepest' % margin,
+        ' * call:',
+        ' *',
+    ] + [' *   ' + line for line in why] + [
+        ' */',
+        '',
+        '#ifndef STACK_SIZES_H',
+        '#define STACK_SIZES_H',
+        '',
+        '#ifdef STACK_PROFILE',
+        '',
+    ]
+    for suffix, _ in TASKS:
+        lines.append('#define STACK_SIZE_%-8s %d' % (suffix, PROFILE_SIZES[suffix]))
+    lines += ['', '#else', '']
+    for suffix, _ in TASKS:
+        used = PROFILE_SIZES[suffix] - marks[suffix]
+        lines.append('#define STACK_SIZE_%-8s (%d + %d)' % (suffix, used, margin))
+    lines += ['', '#endif', '', '#endif', '']
+    return '\n'.join(lines)
+
+
+def main(argv):
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    sub = parser.add_subparsers(dest='cmd', required=True)
+
+    mea = sub.add_parser('measure', help='run the workload, print the high-water marks')
+    mea.add_argument('broker')
+    mea.add_argument('--port', type=int, default=1883)
+    mea.add_argument('--updates', type=int, default=20)
+    mea.add_argument('--timeout', type=int, default=60, help='seconds to wait for a record')
+    mea.add_argument('-o', '--output', help='write the marks to this json file')
+
+    gen = sub.add_parser('generate', help='write include/stack_sizes.h from the marks')
+    gen.add_argument('marks')
+    gen.add_argument('--su', nargs='+', default=SU_DIRS,
+                     help='-fstack-usage files, or directories to search')
+    gen.add_argument('--margin', type=int, help='override the computed margin')
+    gen.add_argument('--header', default=HEADER)
+
+    args = parser.parse_args(argv)
+
+    if args.cmd == 'measure':
+        marks = measure(args.broker, args.port, args.updates, args.timeout)
+        text = json.dumps(marks, indent=1)
+        if args.output:
+            with open(args.output, 'w') as f:
+                f.write(text + '\n')
+        print(text)
+        return 0
+
+    with open(args.marks) as f:
+        marks = json.load(f)
+    missing = [suffix for suffix, _ in TASKS if suffix not in marks]
+    if missing:
+        print('no mark for %s' % ', '.join(missing), file=sys.stderr)
+        return 1
+    margin, why = interrupt_margin(read_stack_usage(args.su))
+    if args.margin is not None:
+        if args.margin < margin:
+            print('margin %d is below the interrupt frame, %d' % (args.margin, margin),
+                  file=sys.stderr)
+        margin, why = args.margin, ['%3d  given on the command line' % args.margin]
+    with open(args.header, 'w') as f:
+        f.write(generate(marks, margin, why))
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main(sys.argv[1:]))
@@ -0,0 +1,100 @@
+#!/usr/bin/env python3
+#
+# Copyright (C) 2024 Vinicius Silva. All Rights Reserved.
+#
+# Permission is hereby granted, free of charge, to any person obtaining a copy of
+# this software and associated documentation files (the "Software"), to deal in
+# the Software without restriction, including without limitation the rights to
+# use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+# the Software, and to permit persons to whom the Software is furnished to do so,
+# subject to the following conditions:
+#
+# The above copyright notice and this permission notice shall be included in all
+# copies or substantial portions of the Software.
+#
+# THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+# IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+# FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+# COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+# IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+# CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+#
+
+
+"""Tests for tools/app_protocol.py: python3 -m unittest discover tools"""
+
+import contextlib
+import io
+import unittest
+
+import app_protocol as ap
+
+
+class CodecTest(unittest.TestCase):
+
+    def test_round_trip(self):
+        for name, opcode in ap.OPCODES.items():
+            with self.subTest(opcode=name):
+                frame = ap.encode(opcode, 7, 3, 1390)
+                self.assertEqual(len(frame), ap.FRAME_SIZE)
+                self.assertEqual(ap.decode(frame), (opcode, 7, 3, 1390))
+
+    def test_seq_wraps(self):
+        self.assertEqual(ap.decode(ap.encode(ap.OPCODES['read'], 256 + 5))[1], 5)
+
+    def test_docstring_vector(self):
+        frame = bytes.fromhex('81 81 07 00 6e 05')
+        self.assertEqual(ap.decode(frame), (ap.OPCODES['reading'], 7, 0, 1390))
+        self.assertEqual(ap.describe(frame), 'reading seq=7 status=ok value=1390')
+        self.assertEqual(ap.encode(ap.OPCODES['output'], 7, 3, 1).hex(' '), '81 01 07 03 01 00')
+
+    def test_bad_mark(self):
+        for first in (0x01, 0x80, 0x82, 0xff):
+            with self.subTest(first=first):
+                with self.assertRaisesRegex(ap.FrameError, 'bad_version'):
+                    ap.decode(bytes([first, 1, 0, 0, 0, 0]))
+
+    def test_empty(self):
+        with self.assertRaisesRegex(ap.FrameError, 'bad_version'):
+            ap.decode(b'')
+
+    def test_short_and_long(self):
+        frame = ap.encode(ap.OPCODES['read'])
+        for payload in (frame[:1], frame[:-1], frame + b'\x00'):
+            with self.subTest(length=len(payload)):
+                with self.assertRaisesRegex(ap.FrameError, 'bad_length'):
+                    ap.decode(payload)
+
+    def test_encode_out_of_range(self):
+        for arg, value in ((256, 0), (-1, 0), (0, 65536), (0, -1)):
+            with self.subTest(arg=arg, value=value):
+                with self.assertRaises(ValueError):
+                    ap.encode(ap.OPCODES['output'], 0, arg, value)
+
+
+class CommandLineTest(unittest.TestCase):
+
+    def run_main(self, argv):
+        out = io.StringIO()
+        with contextlib.redirect_stdout(out):
+            status = ap.main(argv)
+        return status, out.getvalue()
+
+    def test_encode(self):
+        self.assertEqual(self.run_main(['encode', 'output', '3', '1', '--seq', '7']),
+                         (0, '81 01 07 03 01 00\n'))
+
+    def test_decode(self):
+        self.assertEqual(self.run_main(['decode', '81', '81', '07', '00', '6e', '05']),
+                         (0, 'reading seq=7 status=ok value=1390\n'))
+
+    def test_encode_out_of_range_is_a_usage_error(self):
+        err = io.StringIO()
+        with contextlib.redirect_stderr(err), self.assertRaises(SystemExit) as cm:
+            ap.main(['encode', 'output', '3', '70000'])
+        self.assertEqual(cm.exception.code, 2)
+        self.assertIn('out of range', err.getvalue())
+
+
+if __name__ == '__main__':
+    unittest.main()